@@ -0,0 +1,328 @@
+/*
+ * headend - local stand-in for an IPTV RTSP head-end, used by `make bench`
+ *
+ * Answers OPTIONS, DESCRIBE, SETUP, PLAY, GET_PARAMETER and TEARDOWN and
+ * streams a synthetic MPEG-TS over RTP (payload type 33), interleaved on the
+ * RTSP connection. DESCRIBE of /redirect/<x> answers 302 to /live/<x>, like
+ * the head-ends that bounce every zap to an edge server.
+ *
+ * The stream carries PAT/PMT every 100 ms, an H.264 video PID with a keyframe
+ * (random access indicator and IDR) every GOP, and an audio PID.
+ *
+ * Usage: headend [-p port] [-b mbit] [-g gop_ms]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define TS_PACKET_SIZE 188
+#define TS_PER_RTP 7
+#define PID_PMT 0x100
+#define PID_VIDEO 0x101
+#define PID_AUDIO 0x102
+#define MAX_REQ 4096
+
+static int g_port = 8554;
+static double g_mbit = 8.0;
+static int g_gop_ms = 1000;
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint32_t crc32_mpeg(const unsigned char *p, int len) {
+    uint32_t crc = 0xffffffff;
+    while (len--) {
+        crc ^= (uint32_t)*p++ << 24;
+        for (int i = 0; i < 8; i++)
+            crc = crc & 0x80000000 ? (crc << 1) ^ 0x04c11db7 : crc << 1;
+    }
+    return crc;
+}
+
+/* TS generator state */
+struct tsgen {
+    uint8_t cc[0x2000];
+    uint64_t n;                 /* packets generated */
+    uint64_t pkts_per_sec;
+};
+
+static void ts_header(unsigned char *p, int pid, int pusi, struct tsgen *g) {
+    p[0] = 0x47;
+    p[1] = (pusi ? 0x40 : 0) | (pid >> 8);
+    p[2] = pid & 0xff;
+    p[3] = 0x10 | (g->cc[pid]++ & 0x0f);
+}
+
+static void ts_psi(unsigned char *p, int pid, const unsigned char *sec, int len, struct tsgen *g) {
+    ts_header(p, pid, 1, g);
+    p[4] = 0;
+    memcpy(p + 5, sec, len);
+    uint32_t crc = crc32_mpeg(sec, len);
+    p[5 + len] = crc >> 24;
+    p[6 + len] = crc >> 16;
+    p[7 + len] = crc >> 8;
+    p[8 + len] = crc;
+    memset(p + 9 + len, 0xff, TS_PACKET_SIZE - 9 - len);
+}
+
+static void ts_next(unsigned char *p, struct tsgen *g) {
+    uint64_t i = g->n++;
+    uint64_t psi_every = g->pkts_per_sec / 10 ? g->pkts_per_sec / 10 : 1;
+    uint64_t gop = g->pkts_per_sec * g_gop_ms / 1000;
+
+    if (gop == 0) gop = 1;
+    if (i % psi_every == 0) {
+        static const unsigned char pat[] = {
+            0x00, 0xb0, 0x0d, 0x00, 0x01, 0xc1, 0x00, 0x00, 0x00, 0x01, 0xe0 | (PID_PMT >> 8), PID_PMT & 0xff
+        };
+        ts_psi(p, 0, pat, sizeof(pat), g);
+    } else if (i % psi_every == 1) {
+        static const unsigned char pmt[] = {
+            0x02, 0xb0, 0x17, 0x00, 0x01, 0xc1, 0x00, 0x00, 0xe0 | (PID_VIDEO >> 8), PID_VIDEO & 0xff,
+            0xf0, 0x00,
+            0x1b, 0xe0 | (PID_VIDEO >> 8), PID_VIDEO & 0xff, 0xf0, 0x00,
+            0x0f, 0xe0 | (PID_AUDIO >> 8), PID_AUDIO & 0xff, 0xf0, 0x00
+        };
+        ts_psi(p, PID_PMT, pmt, sizeof(pmt), g);
+    } else if (i % 12 == 6) {
+        ts_header(p, PID_AUDIO, 0, g);
+        memset(p + 4, 0xaa, TS_PACKET_SIZE - 4);
+    } else if (i % gop == 2) {
+        /* Keyframe: adaptation field with RAI, then a PES carrying an IDR slice */
+        static const unsigned char pes[] = {
+            0x00, 0x00, 0x01, 0xe0, 0x00, 0x00, 0x80, 0x00, 0x00,
+            0x00, 0x00, 0x00, 0x01, 0x09, 0xf0, 0x00, 0x00, 0x00, 0x01, 0x65
+        };
+        ts_header(p, PID_VIDEO, 1, g);
+        p[3] |= 0x20;
+        p[4] = 1;
+        p[5] = 0x40;
+        memcpy(p + 6, pes, sizeof(pes));
+        memset(p + 6 + sizeof(pes), 0xbb, TS_PACKET_SIZE - 6 - sizeof(pes));
+    } else if (i % 40 == 3) {
+        /* Picture start, alternating reference and non-reference slices */
+        static unsigned char pes[] = {
+            0x00, 0x00, 0x01, 0xe0, 0x00, 0x00, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x41
+        };
+        pes[13] = (i / 40) % 2 ? 0x41 : 0x01;
+        ts_header(p, PID_VIDEO, 1, g);
+        memcpy(p + 4, pes, sizeof(pes));
+        memset(p + 4 + sizeof(pes), 0xdd, TS_PACKET_SIZE - 4 - sizeof(pes));
+    } else {
+        ts_header(p, PID_VIDEO, 0, g);
+        memset(p + 4, 0xcc, TS_PACKET_SIZE - 4);
+    }
+}
+
+static int send_all(int fd, const void *buf, int len) {
+    const char *p = buf;
+    while (len > 0) {
+        int n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) {
+                struct pollfd pfd = { fd, POLLOUT, 0 };
+                poll(&pfd, 1, 1000);
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static const char *header_value(const char *req, const char *name, char *out, int len) {
+    const char *p = req;
+    int nlen = strlen(name);
+
+    out[0] = '\0';
+    while ((p = strstr(p, "\r\n")) != NULL) {
+        p += 2;
+        if (strncasecmp(p, name, nlen) == 0 && p[nlen] == ':') {
+            p += nlen + 1;
+            while (*p == ' ') p++;
+            int n = strcspn(p, "\r\n");
+            if (n >= len) n = len - 1;
+            memcpy(out, p, n);
+            out[n] = '\0';
+            return out;
+        }
+    }
+    return NULL;
+}
+
+/* Handle one request; returns 1 once PLAY started, -1 to close */
+static int handle_request(int fd, const char *req, uint32_t session) {
+    char method[32], url[1024], cseq[32], transport[256], resp[2048];
+    int len;
+
+    if (sscanf(req, "%31s %1023s", method, url) != 2) return -1;
+    header_value(req, "CSeq", cseq, sizeof(cseq));
+
+    const char *path = strstr(url, "://");
+    path = path ? strchr(path + 3, '/') : url;
+    if (!path) path = "/";
+
+    if (strcmp(method, "OPTIONS") == 0) {
+        len = snprintf(resp, sizeof(resp), "RTSP/1.0 200 OK\r\nCSeq: %s\r\n"
+                       "Public: OPTIONS, DESCRIBE, SETUP, PLAY, TEARDOWN, GET_PARAMETER\r\n\r\n", cseq);
+    } else if (strcmp(method, "DESCRIBE") == 0 && strncmp(path, "/redirect/", 10) == 0) {
+        len = snprintf(resp, sizeof(resp), "RTSP/1.0 302 Moved Temporarily\r\nCSeq: %s\r\n"
+                       "Location: rtsp://127.0.0.1:%d/live/%s\r\n\r\n", cseq, g_port, path + 10);
+    } else if (strcmp(method, "DESCRIBE") == 0) {
+        char sdp[512];
+        int sdp_len = snprintf(sdp, sizeof(sdp),
+                               "v=0\r\no=- 0 0 IN IP4 127.0.0.1\r\ns=bench\r\nc=IN IP4 0.0.0.0\r\nt=0 0\r\n"
+                               "m=video 0 RTP/AVP 33\r\na=rtpmap:33 MP2T/90000\r\n");
+        len = snprintf(resp, sizeof(resp), "RTSP/1.0 200 OK\r\nCSeq: %s\r\nContent-Base: %s/\r\n"
+                       "Content-Type: application/sdp\r\nContent-Length: %d\r\n\r\n%s",
+                       cseq, url, sdp_len, sdp);
+    } else if (strcmp(method, "SETUP") == 0) {
+        header_value(req, "Transport", transport, sizeof(transport));
+        if (!strstr(transport, "RTP/AVP/TCP"))
+            len = snprintf(resp, sizeof(resp), "RTSP/1.0 461 Unsupported Transport\r\nCSeq: %s\r\n\r\n", cseq);
+        else
+            len = snprintf(resp, sizeof(resp), "RTSP/1.0 200 OK\r\nCSeq: %s\r\n"
+                           "Transport: RTP/AVP/TCP;unicast;interleaved=0-1\r\n"
+                           "Session: %08X;timeout=60\r\n\r\n", cseq, session);
+    } else if (strcmp(method, "PLAY") == 0 || strcmp(method, "GET_PARAMETER") == 0) {
+        len = snprintf(resp, sizeof(resp), "RTSP/1.0 200 OK\r\nCSeq: %s\r\nSession: %08X\r\n\r\n",
+                       cseq, session);
+    } else if (strcmp(method, "TEARDOWN") == 0) {
+        len = snprintf(resp, sizeof(resp), "RTSP/1.0 200 OK\r\nCSeq: %s\r\n\r\n", cseq);
+        send_all(fd, resp, len);
+        return -1;
+    } else {
+        len = snprintf(resp, sizeof(resp), "RTSP/1.0 501 Not Implemented\r\nCSeq: %s\r\n\r\n", cseq);
+    }
+    if (send_all(fd, resp, len) < 0) return -1;
+    return strcmp(method, "PLAY") == 0;
+}
+
+static void serve(int fd) {
+    static struct tsgen gen;
+    unsigned char frame[4 + 12 + TS_PER_RTP * TS_PACKET_SIZE];
+    char req[MAX_REQ + 1];
+    int req_len = 0, playing = 0;
+    uint16_t seq = 0;
+    uint32_t session = getpid() * 2654435761u;
+    uint64_t start = 0, sent = 0;
+
+    gen.pkts_per_sec = (uint64_t)(g_mbit * 1000000 / 8 / TS_PACKET_SIZE);
+    if (gen.pkts_per_sec < TS_PER_RTP) gen.pkts_per_sec = TS_PER_RTP;
+
+    while (1) {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if (poll(&pfd, 1, playing ? 5 : 60000) < 0 && errno != EINTR) break;
+
+        if (pfd.revents) {
+            int n = recv(fd, req + req_len, MAX_REQ - req_len, 0);
+            if (n <= 0) break;
+            req_len += n;
+            req[req_len] = '\0';
+            char *end;
+            while ((end = strstr(req, "\r\n\r\n")) != NULL) {
+                int r = handle_request(fd, req, session);
+                if (r < 0) return;
+                if (r > 0 && !playing) {
+                    playing = 1;
+                    start = now_us();
+                }
+                req_len -= end + 4 - req;
+                memmove(req, end + 4, req_len + 1);
+            }
+            if (req_len >= MAX_REQ) break;
+        }
+        if (!playing) continue;
+
+        /* Send whatever is due at the configured rate */
+        uint64_t due = (now_us() - start) * gen.pkts_per_sec / 1000000;
+        while (sent + TS_PER_RTP <= due) {
+            frame[0] = '$';
+            frame[1] = 0;
+            frame[2] = (12 + TS_PER_RTP * TS_PACKET_SIZE) >> 8;
+            frame[3] = (12 + TS_PER_RTP * TS_PACKET_SIZE) & 0xff;
+            uint32_t ts90k = (uint32_t)((now_us() - start) * 9 / 100);
+            unsigned char *rtp = frame + 4;
+            rtp[0] = 0x80;
+            rtp[1] = 33;
+            rtp[2] = seq >> 8;
+            rtp[3] = seq & 0xff;
+            rtp[4] = ts90k >> 24;
+            rtp[5] = ts90k >> 16;
+            rtp[6] = ts90k >> 8;
+            rtp[7] = ts90k;
+            memcpy(rtp + 8, "BNCH", 4);
+            for (int i = 0; i < TS_PER_RTP; i++)
+                ts_next(rtp + 12 + i * TS_PACKET_SIZE, &gen);
+            if (send_all(fd, frame, sizeof(frame)) < 0) return;
+            seq++;
+            sent += TS_PER_RTP;
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:b:g:")) != -1) {
+        switch (opt) {
+            case 'p': g_port = atoi(optarg); break;
+            case 'b': g_mbit = atof(optarg); break;
+            case 'g': g_gop_ms = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-p port] [-b mbit] [-g gop_ms]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    signal(SIGCHLD, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+
+    int lfd = socket(AF_INET, SOCK_STREAM, 0);
+    int yes = 1;
+    struct sockaddr_in addr;
+    setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(g_port);
+    if (bind(lfd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(lfd, 128) < 0) {
+        perror("headend: bind");
+        return 1;
+    }
+
+    while (1) {
+        int fd = accept(lfd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            perror("headend: accept");
+            return 1;
+        }
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(lfd);
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+            serve(fd);
+            _exit(0);
+        }
+        close(fd);
+    }
+}
@@ -0,0 +1,450 @@
+/*
+ * loadgen - HTTP viewer load generator for http2rtsp, used by `make bench`
+ *
+ * Opens N concurrent viewers spread over C channels, measures the zap time of
+ * each one (TCP connect to first byte of TS payload) and, once every viewer
+ * has started or the warm-up expired, samples the proxy process tree over the
+ * measurement window:
+ *
+ *   - delivered Mbit/s across all viewers
+ *   - CPU time (user + system, including reaped children)
+ *   - syscalls per MB delivered, counted with the raw_syscalls:sys_enter
+ *     tracepoint through perf_event_open (null when tracefs or perf events
+ *     are not available), and context switches per MB
+ *   - memory per viewer: PSS (RSS if smaps_rollup is missing) of the tree
+ *     while loaded minus before any viewer connected, divided by N
+ *
+ * The result is printed as a single JSON object on stdout.
+ *
+ * Usage: loadgen -u url_prefix -p pid [-n viewers] [-c channels] [-d sec] [-w sec]
+ *        viewer i requests <url_prefix><i % channels>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <time.h>
+#include <stdint.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/perf_event.h>
+
+#define MAX_TREE 4096
+#define RECV_SIZE 65536
+
+enum { V_CONNECTING, V_HEADER, V_BODY, V_DONE };
+
+struct viewer {
+    int fd;
+    int state;
+    uint64_t start_us;
+    double zap_ms;
+    char hdr[1024];
+    int hdr_len;
+};
+
+struct sample {
+    double t;
+    unsigned long long bytes;
+    double cpu_sec;
+    unsigned long long ctxsw;
+    unsigned long long syscalls;
+    long mem_kb;
+};
+
+static int g_viewers = 10;
+static int g_channels = 1;
+static int g_duration = 10;
+static int g_warmup = 5;
+static pid_t g_pid;
+static char g_host[64] = "127.0.0.1";
+static int g_port = 8090;
+static char g_path[1024] = "/";
+
+static unsigned long long g_bytes;
+static int g_perf_fds[MAX_TREE];
+static int g_perf_count;
+static int g_perf_ok = 1;
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Parse http://host:port/path into the globals */
+static int parse_url(const char *url) {
+    if (strncmp(url, "http://", 7) != 0) return -1;
+    url += 7;
+    const char *slash = strchr(url, '/');
+    const char *colon = strchr(url, ':');
+    int hlen;
+
+    if (!slash) slash = url + strlen(url);
+    if (colon && colon < slash) {
+        g_port = atoi(colon + 1);
+        hlen = colon - url;
+    } else {
+        hlen = slash - url;
+    }
+    if (hlen <= 0 || hlen >= (int)sizeof(g_host)) return -1;
+    memcpy(g_host, url, hlen);
+    g_host[hlen] = '\0';
+    snprintf(g_path, sizeof(g_path), "%s", *slash ? slash : "/");
+    return 0;
+}
+
+/* Collect the proxy pid and its direct children (fork mode handlers, DNS resolver) */
+static int process_tree(pid_t *out) {
+    int n = 0;
+    DIR *d = opendir("/proc");
+    struct dirent *e;
+    char path[64], buf[512];
+
+    out[n++] = g_pid;
+    if (!d) return n;
+    while ((e = readdir(d)) != NULL && n < MAX_TREE) {
+        pid_t pid = atoi(e->d_name);
+        if (pid <= 0 || pid == g_pid) continue;
+        snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+        FILE *f = fopen(path, "r");
+        if (!f) continue;
+        int len = fread(buf, 1, sizeof(buf) - 1, f);
+        fclose(f);
+        buf[len > 0 ? len : 0] = '\0';
+        char *p = strrchr(buf, ')');
+        int ppid;
+        if (p && sscanf(p + 2, "%*c %d", &ppid) == 1 && ppid == g_pid)
+            out[n++] = pid;
+    }
+    closedir(d);
+    return n;
+}
+
+static double proc_cpu(pid_t pid, int with_children) {
+    char path[64], buf[1024];
+    unsigned long long ut, st, cut, cst;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE *f = fopen(path, "r");
+    if (!f) return 0;
+    int len = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[len > 0 ? len : 0] = '\0';
+    char *p = strrchr(buf, ')');
+    if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu %llu %llu",
+                     &ut, &st, &cut, &cst) != 4)
+        return 0;
+    if (!with_children) cut = cst = 0;
+    return (double)(ut + st + cut + cst) / sysconf(_SC_CLK_TCK);
+}
+
+static unsigned long long proc_ctxsw(pid_t pid) {
+    char path[64], line[256];
+    unsigned long long total = 0, v;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    FILE *f = fopen(path, "r");
+    if (!f) return 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "voluntary_ctxt_switches: %llu", &v) == 1 ||
+            sscanf(line, "nonvoluntary_ctxt_switches: %llu", &v) == 1)
+            total += v;
+    }
+    fclose(f);
+    return total;
+}
+
+static long proc_mem_kb(pid_t pid) {
+    char path[64], line[256];
+    long kb = -1, pages;
+
+    snprintf(path, sizeof(path), "/proc/%d/smaps_rollup", pid);
+    FILE *f = fopen(path, "r");
+    if (f) {
+        while (fgets(line, sizeof(line), f))
+            if (sscanf(line, "Pss: %ld kB", &kb) == 1) break;
+        fclose(f);
+        if (kb >= 0) return kb;
+    }
+    snprintf(path, sizeof(path), "/proc/%d/statm", pid);
+    f = fopen(path, "r");
+    if (!f) return 0;
+    if (fscanf(f, "%*s %ld", &pages) != 1) pages = 0;
+    fclose(f);
+    return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static int tracepoint_id(void) {
+    static const char *paths[] = {
+        "/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+        "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id",
+    };
+    for (unsigned i = 0; i < sizeof(paths) / sizeof(paths[0]); i++) {
+        FILE *f = fopen(paths[i], "r");
+        int id;
+        if (!f) continue;
+        if (fscanf(f, "%d", &id) != 1) id = -1;
+        fclose(f);
+        if (id >= 0) return id;
+    }
+    return -1;
+}
+
+/* Attach a syscall counter to every process of the tree; inherit covers later forks */
+static void perf_attach(const pid_t *tree, int n) {
+    struct perf_event_attr attr;
+    int id = tracepoint_id();
+
+    if (id < 0) {
+        g_perf_ok = 0;
+        return;
+    }
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_TRACEPOINT;
+    attr.size = sizeof(attr);
+    attr.config = id;
+    attr.inherit = 1;
+    attr.exclude_kernel = 0;
+    for (int i = 0; i < n; i++) {
+        int fd = syscall(SYS_perf_event_open, &attr, tree[i], -1, -1, 0);
+        if (fd < 0) {
+            g_perf_ok = 0;
+            return;
+        }
+        g_perf_fds[g_perf_count++] = fd;
+    }
+}
+
+static unsigned long long perf_read(void) {
+    unsigned long long total = 0, v;
+    for (int i = 0; i < g_perf_count; i++)
+        if (read(g_perf_fds[i], &v, sizeof(v)) == sizeof(v))
+            total += v;
+    return total;
+}
+
+static void take_sample(struct sample *s, uint64_t t0) {
+    static pid_t tree[MAX_TREE];
+    int n = process_tree(tree);
+
+    memset(s, 0, sizeof(*s));
+    s->t = (now_us() - t0) / 1e6;
+    s->bytes = g_bytes;
+    for (int i = 0; i < n; i++) {
+        s->cpu_sec += proc_cpu(tree[i], i == 0);
+        s->ctxsw += proc_ctxsw(tree[i]);
+        s->mem_kb += proc_mem_kb(tree[i]);
+    }
+    s->syscalls = perf_read();
+}
+
+static int viewer_connect(struct viewer *v, int epfd, const struct sockaddr_in *sa) {
+    struct epoll_event ev;
+
+    v->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (v->fd < 0) return -1;
+    v->start_us = now_us();
+    v->state = V_CONNECTING;
+    if (connect(v->fd, (const struct sockaddr*)sa, sizeof(*sa)) < 0 && errno != EINPROGRESS)
+        return -1;
+    ev.events = EPOLLOUT | EPOLLIN;
+    ev.data.ptr = v;
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, v->fd, &ev);
+}
+
+static void viewer_fail(struct viewer *v) {
+    if (v->fd >= 0) close(v->fd);
+    v->fd = -1;
+    v->state = V_DONE;
+}
+
+static void viewer_io(struct viewer *v, int epfd, int index, uint32_t events) {
+    static char buf[RECV_SIZE];
+
+    if (v->state == V_CONNECTING) {
+        if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) return;
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(v->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err) {
+            viewer_fail(v);
+            return;
+        }
+        char req[1200];
+        int n = snprintf(req, sizeof(req), "GET %s%d HTTP/1.1\r\nHost: %s:%d\r\nUser-Agent: loadgen\r\n\r\n",
+                         g_path, index % g_channels, g_host, g_port);
+        if (send(v->fd, req, n, MSG_NOSIGNAL) != n) {
+            viewer_fail(v);
+            return;
+        }
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = v };
+        epoll_ctl(epfd, EPOLL_CTL_MOD, v->fd, &ev);
+        v->state = V_HEADER;
+        return;
+    }
+
+    while (1) {
+        int n = recv(v->fd, buf, sizeof(buf), 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EAGAIN) return;
+        if (n <= 0) {
+            viewer_fail(v);
+            return;
+        }
+        int body = 0;
+        if (v->state == V_HEADER) {
+            int copy = n < (int)sizeof(v->hdr) - 1 - v->hdr_len ? n : (int)sizeof(v->hdr) - 1 - v->hdr_len;
+            memcpy(v->hdr + v->hdr_len, buf, copy);
+            int old = v->hdr_len;
+            v->hdr_len += copy;
+            v->hdr[v->hdr_len] = '\0';
+            char *end = strstr(v->hdr, "\r\n\r\n");
+            if (!end) {
+                if (v->hdr_len >= (int)sizeof(v->hdr) - 1) viewer_fail(v);
+                continue;
+            }
+            if (strncmp(v->hdr, "HTTP/1.", 7) != 0 || strncmp(v->hdr + 9, "200", 3) != 0) {
+                viewer_fail(v);
+                return;
+            }
+            body = n - (end + 4 - v->hdr - old);
+            v->state = V_BODY;
+        } else {
+            body = n;
+        }
+        if (body > 0 && v->zap_ms < 0)
+            v->zap_ms = (now_us() - v->start_us) / 1000.0;
+        g_bytes += body;
+    }
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(const double *sorted, int n, double p) {
+    int i = (int)(p * n + 0.999999) - 1;
+    if (n == 0) return 0;
+    if (i < 0) i = 0;
+    if (i >= n) i = n - 1;
+    return sorted[i];
+}
+
+int main(int argc, char *argv[]) {
+    const char *url = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "u:p:n:c:d:w:")) != -1) {
+        switch (opt) {
+            case 'u': url = optarg; break;
+            case 'p': g_pid = atoi(optarg); break;
+            case 'n': g_viewers = atoi(optarg); break;
+            case 'c': g_channels = atoi(optarg); break;
+            case 'd': g_duration = atoi(optarg); break;
+            case 'w': g_warmup = atoi(optarg); break;
+            default: url = NULL; optind = argc; break;
+        }
+    }
+    if (!url || g_pid <= 0 || g_viewers <= 0 || g_channels <= 0 || parse_url(url) < 0) {
+        fprintf(stderr, "Usage: %s -u http://host:port/prefix -p pid [-n viewers] [-c channels] [-d sec] [-w sec]\n",
+                argv[0]);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t)g_viewers + 64) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    struct sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(g_port);
+    if (inet_pton(AF_INET, g_host, &sa.sin_addr) != 1) {
+        fprintf(stderr, "loadgen: host must be an IPv4 address\n");
+        return 1;
+    }
+
+    struct viewer *v = calloc(g_viewers, sizeof(*v));
+    double *zap = calloc(g_viewers, sizeof(*zap));
+    int epfd = epoll_create1(0);
+    if (!v || !zap || epfd < 0) return 1;
+
+    uint64_t t0 = now_us();
+    struct sample idle, begin, end;
+    take_sample(&idle, t0);
+
+    for (int i = 0; i < g_viewers; i++) {
+        v[i].zap_ms = -1;
+        if (viewer_connect(&v[i], epfd, &sa) < 0) viewer_fail(&v[i]);
+    }
+
+    /* Warm-up: wait until every viewer has its first byte or failed */
+    int measuring = 0;
+    uint64_t phase_end = now_us() + (uint64_t)g_warmup * 1000000;
+    struct epoll_event events[256];
+    while (1) {
+        int n = epoll_wait(epfd, events, 256, 100);
+        for (int i = 0; i < n; i++) {
+            struct viewer *vw = events[i].data.ptr;
+            viewer_io(vw, epfd, vw - v, events[i].events);
+        }
+        uint64_t now = now_us();
+        if (!measuring) {
+            int pending = 0;
+            for (int i = 0; i < g_viewers; i++)
+                if (v[i].state != V_DONE && v[i].zap_ms < 0) pending++;
+            if (pending == 0 || now >= phase_end) {
+                /* Re-scan the tree: fork mode has one handler per viewer by now */
+                static pid_t tree[MAX_TREE];
+                perf_attach(tree, process_tree(tree));
+                take_sample(&begin, t0);
+                measuring = 1;
+                phase_end = now + (uint64_t)g_duration * 1000000;
+            }
+        } else if (now >= phase_end) {
+            take_sample(&end, t0);
+            break;
+        }
+    }
+
+    int ok = 0, streaming = 0;
+    for (int i = 0; i < g_viewers; i++) {
+        if (v[i].zap_ms >= 0) zap[ok++] = v[i].zap_ms;
+        if (v[i].state == V_BODY) streaming++;
+    }
+    qsort(zap, ok, sizeof(*zap), cmp_double);
+
+    double dt = end.t - begin.t;
+    double mb = (end.bytes - begin.bytes) / 1e6;
+    double cpu = end.cpu_sec - begin.cpu_sec;
+
+    printf("{\"viewers\":%d,\"channels\":%d,\"started\":%d,\"streaming\":%d,"
+           "\"zap_p50_ms\":%.1f,\"zap_p99_ms\":%.1f,\"zap_max_ms\":%.1f,"
+           "\"window_sec\":%.2f,\"mbit_s\":%.2f,\"cpu_sec\":%.3f,\"cpu_pct\":%.1f,",
+           g_viewers, g_channels, ok, streaming,
+           percentile(zap, ok, 0.50), percentile(zap, ok, 0.99), ok ? zap[ok - 1] : 0,
+           dt, dt > 0 ? mb * 8 / dt : 0, cpu, dt > 0 ? cpu * 100 / dt : 0);
+    if (g_perf_ok && mb > 0)
+        printf("\"syscalls_per_mb\":%.1f,", (end.syscalls - begin.syscalls) / mb);
+    else
+        printf("\"syscalls_per_mb\":null,");
+    printf("\"ctxsw_per_mb\":%.1f,\"mem_idle_kb\":%ld,\"mem_loaded_kb\":%ld,\"mem_per_viewer_kb\":%.1f}\n",
+           mb > 0 ? (end.ctxsw - begin.ctxsw) / mb : 0, idle.mem_kb, end.mem_kb,
+           (double)(end.mem_kb - idle.mem_kb) / g_viewers);
+
+    for (int i = 0; i < g_viewers; i++)
+        if (v[i].fd >= 0) close(v[i].fd);
+    return 0;
+}
@@ -0,0 +1,42 @@
+#!/bin/sh
+# End-to-end benchmark: local head-end -> http2rtsp -> N HTTP viewers.
+# Prints one JSON object per run on stdout; progress goes to stderr.
+#
+# Environment:
+#   VIEWERS   concurrent viewers (default 50)
+#   CHANNELS  distinct channels the viewers are spread over (default 5)
+#   MBIT      bitrate of each channel in Mbit/s (default 8)
+#   DURATION  measurement window in seconds (default 10)
+#   WARMUP    max seconds to wait for every viewer to start (default 10)
+#   REDIRECT  1 to go through a 302 on every zap, like most IPTV head-ends (default 1)
+#   ARGS      extra http2rtsp options, e.g. ARGS=-F for fork mode
+#   PORT      http2rtsp port (default 18090), head-end uses PORT+1
+
+set -e
+cd "$(dirname "$0")"
+
+VIEWERS=${VIEWERS:-50}
+CHANNELS=${CHANNELS:-5}
+MBIT=${MBIT:-8}
+DURATION=${DURATION:-10}
+WARMUP=${WARMUP:-10}
+REDIRECT=${REDIRECT:-1}
+PORT=${PORT:-18090}
+RTSP_PORT=$((PORT + 1))
+
+[ "$REDIRECT" = 1 ] && CH_PATH=redirect || CH_PATH=live
+
+./headend -p "$RTSP_PORT" -b "$MBIT" &
+HEADEND=$!
+../http2rtsp -T -p "$PORT" -c $((VIEWERS + 16)) $ARGS &
+PROXY=$!
+trap 'kill $HEADEND $PROXY 2>/dev/null' EXIT INT TERM
+
+sleep 1
+if ! kill -0 $PROXY 2>/dev/null; then
+    echo "bench: http2rtsp failed to start" >&2
+    exit 1
+fi
+echo "bench: $VIEWERS viewers, $CHANNELS channels at $MBIT Mbit/s, ${DURATION}s ${ARGS:+($ARGS)}" >&2
+./loadgen -u "http://127.0.0.1:$PORT/rtsp/127.0.0.1:$RTSP_PORT/$CH_PATH/ch" -p "$PROXY" \
+    -n "$VIEWERS" -c "$CHANNELS" -d "$DURATION" -w "$WARMUP"
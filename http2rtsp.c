@@ -19,14 +19,44 @@
 #include <sys/select.h>
 #include <fcntl.h>
 #include <sys/prctl.h>
+#include <sys/uio.h>
+#include <ctype.h>
+#include <sys/epoll.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#include <sys/resource.h>
 
 #define VERSION "1.3"
 #define DEFAULT_PORT 8090
 #define DEFAULT_BUF_SIZE (32*1024)
+#define DEFAULT_RING_SIZE (1024*1024)
+#define DEFAULT_QUEUE_MS 500
 #define MAX_CLIENTS 10
 #define MAX_URL_LEN 2048
 #define MAX_HEADER_LEN 4096
 #define RTP_INTERLEAVED 0x24
+#define RTSP_CAP_KNOWN 0x01         /* the server sent a Public header */
+#define RTSP_CAP_GET_PARAMETER 0x02
+#define RTSP_CAP_SET_PARAMETER 0x04
+#define RTP_HEADER_LEN 12
+#define RTP_PT_MP2T 33
+#define RTP_MAX_DROPOUT 3000
+#define RTP_MAX_MISORDER 100
+#define TS_PACKET_SIZE 188
+#define TS_SYNC_BYTE 0x47
+#define UDP_BATCH 16
+#define UDP_PKT_MAX 2048
+#define REORDER_SLOTS 32
+#define REORDER_DEPTH 8
+#define UDP_FIRST_PACKET_TIMEOUT_SEC 3
+#define DEFAULT_UDP_PORT_MIN 40000
+#define DEFAULT_UDP_PORT_MAX 40999
 
 #define BUILD_DATE __DATE__
 #define BUILD_TIME __TIME__
@@ -34,14 +64,43 @@
 /* Configuration constants */
 #define RTSP_MAX_REDIRECTS 5
 #define RTSP_CONNECT_TIMEOUT_SEC 10
+#define CONNECT_RACE_DELAY_MS 250
+#define DNS_MAX_ADDRS 4
+#define DNS_CACHE_SLOTS 64
+#define DNS_CACHE_TTL_SEC 300
+#define DNS_NEGATIVE_TTL_SEC 10
+#define ZAP_CACHE_SLOTS 32
+#define ZAP_CACHE_TTL_SEC 600
+#define DEFAULT_GOP_CACHE_SIZE (8*1024*1024)
+#define GOP_SLOT_SIZE (2*1024*1024)
+#define GOP_FRESH_MS 2000
+#define GOP_MIN_HOLD_MS 10000
 #define RTSP_REQUEST_TIMEOUT_SEC 10
 #define RTSP_RESPONSE_TIMEOUT_SEC 10
+#define HTTP_REQUEST_TIMEOUT_SEC 10
+#define RELAY_IDLE_TIMEOUT_SEC 30
+#define RTSP_DEFAULT_SESSION_TIMEOUT_SEC 60
+#define UPSTREAM_MAX_RECONNECTS 5
+#define UPSTREAM_RECONNECT_DELAY_MS 500
+#define UPSTREAM_STABLE_SEC 30
+#define VIEWER_STALL_TIMEOUT_SEC 30
+#define VQ_STAGE_PACKETS 64
+#define EPOLL_MAX_EVENTS 64
+#define STATS_SESSIONS 64
 
 static int g_port = DEFAULT_PORT;
 static int g_max_clients = MAX_CLIENTS;
 static int g_buf_size = DEFAULT_BUF_SIZE;
+static int g_ring_size = DEFAULT_RING_SIZE;
+static int g_queue_ms = DEFAULT_QUEUE_MS;
+static int g_gop_cache_size = DEFAULT_GOP_CACHE_SIZE;
 static int g_verbose = 0;
 static int g_daemon = 1;
+static int g_fork_mode = 0;
+static int g_transport_udp = 0;
+static int g_udp_port_min = DEFAULT_UDP_PORT_MIN;
+static int g_udp_port_max = DEFAULT_UDP_PORT_MAX;
+static const char *g_capture_dir = NULL;
 
 #define HTTP_200_OK "HTTP/1.0 200 OK\r\nContent-Type: video/mp2t\r\nConnection: close\r\n\r\n"
 #define HTTP_400_BAD "HTTP/1.0 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"
@@ -62,6 +121,24 @@ static void set_tcp_nodelay(int fd) {
     setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
 }
 
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 static int url_decode(const char *src, char *dst, int dst_len) {
     int i, j;
     for (i = 0, j = 0; src[i] && j < dst_len - 1; i++, j++) {
@@ -196,6 +273,23 @@ static int parse_rtsp_url(const char *url, char *host, int *port, char *path, in
     return 0;
 }
 
+/* Build the key used to share one upstream session between viewers of a channel */
+static int normalize_rtsp_url(const char *url, char *key, int key_len) {
+    char host[256], path[MAX_URL_LEN];
+    int port;
+    
+    if (parse_rtsp_url(url, host, &port, path, sizeof(path)) < 0)
+        return -1;
+    for (char *h = host; *h; h++)
+        *h = tolower((unsigned char)*h);
+    
+    if (strchr(host, ':'))
+        snprintf(key, key_len, "rtsp://[%s]:%d%s", host, port, path);
+    else
+        snprintf(key, key_len, "rtsp://%s:%d%s", host, port, path);
+    return 0;
+}
+
 static int send_all(int fd, const char *buf, int len, int timeout_sec) {
     int total = 0;
     fd_set fds;
@@ -220,38 +314,261 @@ static int send_all(int fd, const char *buf, int len, int timeout_sec) {
     return total;
 }
 
-static int recv_line(int fd, char *buf, int max_len, int timeout_sec) {
-    int i = 0;
-    fd_set fds;
-    struct timeval tv;
+/* ============ 运行统计 ============ */
+/*
+ * Counters live in one shared mapping so /stats sees every forked handler.
+ * Global counters and histograms are bumped with atomic adds. A session row
+ * has a single writer, its relay, and is updated with plain stores.
+ * Counters are unsigned long so 32-bit targets need no 64-bit atomics.
+ */
+
+enum { ST_RESOLVE, ST_CONNECT, ST_OPTIONS, ST_DESCRIBE, ST_SETUP, ST_PLAY, ST_FIRST_BYTE, ST_PHASES };
+
+static const char *const g_stats_phase[ST_PHASES] = {
+    "resolve", "connect", "options", "describe", "setup", "play", "first_byte"
+};
+
+/* Upper bounds in ms; the last bucket is +Inf */
+static const int g_stats_bucket[] = { 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000 };
+#define STATS_BUCKETS (int)(sizeof(g_stats_bucket) / sizeof(g_stats_bucket[0]))
+
+struct stats_session {
+    volatile int used;
+    pid_t pid;
+    char url[256];
+    uint64_t started;
+    int viewers;
+    uint32_t rate;              /* bytes per second */
+    uint64_t bytes;
+    uint64_t packets;
+    uint64_t rtp_lost;
+    uint64_t rtp_reordered;
+};
+
+struct stats_table {
+    unsigned long requests;
+    unsigned long rejected;     /* 503 at the client limit */
+    unsigned long failed;       /* upstream setup failures */
+    unsigned long hist[ST_PHASES][STATS_BUCKETS + 1];
+    unsigned long hist_ms[ST_PHASES];
+    struct stats_session s[STATS_SESSIONS];
+};
+
+static struct stats_table *g_stats = NULL;
+
+#define STATS_ADD(field, n) do { if (g_stats) __sync_fetch_and_add(&g_stats->field, (n)); } while (0)
+
+static void stats_observe(int phase, uint64_t ms) {
+    int b = 0;
     
-    while (i < max_len - 1) {
-        FD_ZERO(&fds);
-        FD_SET(fd, &fds);
-        tv.tv_sec = timeout_sec;
-        tv.tv_usec = 0;
-        
-        if (select(fd + 1, &fds, NULL, NULL, &tv) <= 0)
-            return -1;
-        
-        char c;
-        int n = recv(fd, &c, 1, 0);
-        if (n <= 0) return -1;
-        
-        buf[i++] = c;
-        if (c == '\n' && i >= 2 && buf[i-2] == '\r') {
-            buf[i] = '\0';
-            return i;
+    if (!g_stats || phase < 0) return;
+    while (b < STATS_BUCKETS && ms > (uint64_t)g_stats_bucket[b]) b++;
+    __sync_fetch_and_add(&g_stats->hist[phase][b], 1);
+    __sync_fetch_and_add(&g_stats->hist_ms[phase], (unsigned long)ms);
+}
+
+static int stats_method_phase(const char *method) {
+    for (int i = ST_OPTIONS; i <= ST_PLAY; i++) {
+        if (strcasecmp(method, g_stats_phase[i]) == 0) return i;
+    }
+    return -1;
+}
+
+/* Claim a row for a relay; NULL if the table is full */
+static struct stats_session *stats_session_open(const char *url) {
+    if (!g_stats) return NULL;
+    for (int i = 0; i < STATS_SESSIONS; i++) {
+        struct stats_session *s = &g_stats->s[i];
+        if (s->used || !__sync_bool_compare_and_swap(&s->used, 0, 1)) continue;
+        s->pid = getpid();
+        snprintf(s->url, sizeof(s->url), "%s", url);
+        s->started = now_ms();
+        s->viewers = 1;
+        s->rate = 0;
+        s->bytes = s->packets = s->rtp_lost = s->rtp_reordered = 0;
+        return s;
+    }
+    return NULL;
+}
+
+static void stats_session_close(struct stats_session *s) {
+    if (!s) return;
+    __sync_synchronize();
+    s->used = 0;
+}
+
+/* Per depayloaded RTP packet, with the depayloader's running totals */
+static void stats_session_packet(struct stats_session *s, int len, uint64_t lost,
+                                 uint64_t reordered, uint32_t rate) {
+    if (!s) return;
+    s->bytes += len;
+    s->packets++;
+    s->rtp_lost = lost;
+    s->rtp_reordered = reordered;
+    s->rate = rate;
+}
+
+/* Growable text buffer for the stats reply */
+struct strbuf {
+    char *p;
+    int len, cap;
+};
+
+static void sb_printf(struct strbuf *sb, const char *fmt, ...) {
+    va_list ap;
+    int n;
+    
+    if (sb->cap < 0) return;
+    va_start(ap, fmt);
+    n = vsnprintf(sb->p ? sb->p + sb->len : NULL, sb->p ? sb->cap - sb->len : 0, fmt, ap);
+    va_end(ap);
+    if (n < 0) return;
+    if (!sb->p || sb->len + n >= sb->cap) {
+        int cap = (sb->cap ? sb->cap : 4096);
+        while (cap <= sb->len + n) cap *= 2;
+        char *p = realloc(sb->p, cap);
+        if (!p) {
+            sb->cap = -1;
+            return;
         }
+        sb->p = p;
+        sb->cap = cap;
+        va_start(ap, fmt);
+        vsnprintf(sb->p + sb->len, sb->cap - sb->len, fmt, ap);
+        va_end(ap);
     }
-    buf[i] = '\0';
-    return i;
+    sb->len += n;
 }
 
-static int send_rtsp_request(int rtsp_fd, const char *method, const char *url, 
-                             const char *session, int cseq, char *extra_headers) {
-    char req[MAX_HEADER_LEN];
-    int len = snprintf(req, sizeof(req),
+/* URL as a quoted label or JSON string; both escape backslash and double quote */
+static void sb_quote(struct strbuf *sb, const char *s) {
+    sb_printf(sb, "\"");
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') sb_printf(sb, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20) sb_printf(sb, "\\u%04x", *s);
+        else sb_printf(sb, "%c", *s);
+    }
+    sb_printf(sb, "\"");
+}
+
+/* Rows whose owner died without closing them (fork mode) */
+static int stats_session_live(struct stats_session *s) {
+    if (!s->used) return 0;
+    if (s->pid != getpid() && kill(s->pid, 0) < 0 && errno == ESRCH) {
+        s->used = 0;
+        return 0;
+    }
+    return 1;
+}
+
+static void stats_prometheus(struct strbuf *sb) {
+    const struct stats_table *t = g_stats;
+    int active = 0;
+    
+    sb_printf(sb, "# TYPE http2rtsp_requests_total counter\nhttp2rtsp_requests_total %lu\n", t->requests);
+    sb_printf(sb, "# TYPE http2rtsp_rejected_total counter\nhttp2rtsp_rejected_total %lu\n", t->rejected);
+    sb_printf(sb, "# TYPE http2rtsp_setup_failures_total counter\nhttp2rtsp_setup_failures_total %lu\n", t->failed);
+    
+    static const char *const metric[] = {
+        "viewers", "bitrate_bits", "uptime_seconds", "bytes_total", "rtp_packets_total",
+        "rtp_lost_total", "rtp_reordered_total"
+    };
+    for (int m = 0; m < (int)(sizeof(metric) / sizeof(metric[0])); m++) {
+        sb_printf(sb, "# TYPE http2rtsp_session_%s %s\n", metric[m],
+                  strstr(metric[m], "_total") ? "counter" : "gauge");
+        for (int i = 0; i < STATS_SESSIONS; i++) {
+            struct stats_session *s = &g_stats->s[i];
+            uint64_t v[] = { s->viewers, (uint64_t)s->rate * 8, (now_ms() - s->started) / 1000,
+                             s->bytes, s->packets, s->rtp_lost, s->rtp_reordered };
+            if (!stats_session_live(s)) continue;
+            if (m == 0) active++;
+            sb_printf(sb, "http2rtsp_session_%s{url=", metric[m]);
+            sb_quote(sb, s->url);
+            sb_printf(sb, ",pid=\"%d\"} %llu\n", (int)s->pid, (unsigned long long)v[m]);
+        }
+    }
+    sb_printf(sb, "# TYPE http2rtsp_sessions gauge\nhttp2rtsp_sessions %d\n", active);
+    
+    sb_printf(sb, "# TYPE http2rtsp_setup_seconds histogram\n");
+    for (int p = 0; p < ST_PHASES; p++) {
+        unsigned long n = 0;
+        for (int b = 0; b <= STATS_BUCKETS; b++) {
+            n += t->hist[p][b];
+            if (b < STATS_BUCKETS)
+                sb_printf(sb, "http2rtsp_setup_seconds_bucket{phase=\"%s\",le=\"%g\"} %lu\n",
+                          g_stats_phase[p], g_stats_bucket[b] / 1000.0, n);
+            else
+                sb_printf(sb, "http2rtsp_setup_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %lu\n",
+                          g_stats_phase[p], n);
+        }
+        sb_printf(sb, "http2rtsp_setup_seconds_sum{phase=\"%s\"} %g\n", g_stats_phase[p], t->hist_ms[p] / 1000.0);
+        sb_printf(sb, "http2rtsp_setup_seconds_count{phase=\"%s\"} %lu\n", g_stats_phase[p], n);
+    }
+}
+
+static void stats_json(struct strbuf *sb) {
+    const struct stats_table *t = g_stats;
+    const char *sep = "";
+    
+    sb_printf(sb, "{\"requests\":%lu,\"rejected\":%lu,\"setup_failures\":%lu,\"sessions\":[",
+              t->requests, t->rejected, t->failed);
+    for (int i = 0; i < STATS_SESSIONS; i++) {
+        struct stats_session *s = &g_stats->s[i];
+        if (!stats_session_live(s)) continue;
+        sb_printf(sb, "%s{\"url\":", sep);
+        sb_quote(sb, s->url);
+        sb_printf(sb, ",\"pid\":%d,\"viewers\":%d,\"uptime\":%llu,\"bitrate\":%llu,\"bytes\":%llu,"
+                  "\"rtp_packets\":%llu,\"rtp_lost\":%llu,\"rtp_reordered\":%llu}",
+                  (int)s->pid, s->viewers, (unsigned long long)(now_ms() - s->started) / 1000,
+                  (unsigned long long)s->rate * 8, (unsigned long long)s->bytes,
+                  (unsigned long long)s->packets, (unsigned long long)s->rtp_lost,
+                  (unsigned long long)s->rtp_reordered);
+        sep = ",";
+    }
+    sb_printf(sb, "],\"setup_ms\":{");
+    for (int p = 0; p < ST_PHASES; p++) {
+        unsigned long n = 0;
+        sb_printf(sb, "%s\"%s\":{\"buckets\":[", p ? "," : "", g_stats_phase[p]);
+        for (int b = 0; b <= STATS_BUCKETS; b++) {
+            n += t->hist[p][b];
+            sb_printf(sb, "%s%lu", b ? "," : "", t->hist[p][b]);
+        }
+        sb_printf(sb, "],\"count\":%lu,\"sum\":%lu}", n, t->hist_ms[p]);
+    }
+    sb_printf(sb, "},\"bucket_le_ms\":[");
+    for (int b = 0; b < STATS_BUCKETS; b++)
+        sb_printf(sb, "%s%d", b ? "," : "", g_stats_bucket[b]);
+    sb_printf(sb, "]}\n");
+}
+
+/*
+ * Build the full HTTP reply for GET /stats (Prometheus text) or
+ * GET /stats.json. Returns its length and a malloc()ed buffer, 0 if the
+ * request is for something else, or -1 when out of memory.
+ */
+static int stats_reply(const char *request, char **out) {
+    struct strbuf sb = { NULL, 0, 0 };
+    int json;
+    
+    if (strncmp(request, "GET /stats", 10) != 0) return 0;
+    json = strncmp(request + 10, ".json", 5) == 0;
+    if (!strchr(" ?", request[json ? 15 : 10])) return 0;
+    
+    sb_printf(&sb, "HTTP/1.0 200 OK\r\nContent-Type: %s\r\nConnection: close\r\n\r\n",
+              json ? "application/json" : "text/plain; version=0.0.4");
+    if (g_stats && json) stats_json(&sb);
+    else if (g_stats) stats_prometheus(&sb);
+    if (sb.cap < 0) {
+        free(sb.p);
+        return -1;
+    }
+    *out = sb.p;
+    return sb.len;
+}
+
+static int format_rtsp_request(char *req, int req_len, const char *method, const char *url,
+                               const char *session, int cseq, const char *extra_headers) {
+    int len = snprintf(req, req_len,
         "%s %s RTSP/1.0\r\nCSeq: %d\r\nUser-Agent: http2rtsp/%s\r\n%s%s%s%s\r\n",
         method, url, cseq, VERSION,
         extra_headers ? extra_headers : "",
@@ -259,207 +576,378 @@ static int send_rtsp_request(int rtsp_fd, const char *method, const char *url,
         session ? session : "",
         session ? "\r\n" : ""
     );
+    if (len >= req_len) len = req_len - 1;
+    return len;
+}
+
+static int send_rtsp_request(int rtsp_fd, const char *method, const char *url, 
+                             const char *session, int cseq, char *extra_headers) {
+    char req[MAX_HEADER_LEN];
+    int len = format_rtsp_request(req, sizeof(req), method, url, session, cseq, extra_headers);
     return send_all(rtsp_fd, req, len, 5);
 }
 
-static int parse_rtsp_response(int rtsp_fd, char *session, int sess_len, 
-                               int *content_length, int timeout, char *location, int loc_len) {
-    char line[MAX_HEADER_LEN];
-    int cseq = -1, status = 0;
-    *content_length = 0;
-    if (session) session[0] = '\0';
-    if (location) location[0] = '\0';
+/*
+ * Keepalive period for a session: half the timeout from the SETUP response,
+ * or of the RFC 2326 default of 60 seconds.
+ */
+static int rtsp_keepalive_ms(int session_timeout) {
+    if (session_timeout <= 0) session_timeout = RTSP_DEFAULT_SESSION_TIMEOUT_SEC;
+    return session_timeout * 500;
+}
+
+/* GET_PARAMETER when the server lists it in Public, OPTIONS otherwise */
+static const char *rtsp_keepalive_method(unsigned caps) {
+    return caps & RTSP_CAP_GET_PARAMETER ? "GET_PARAMETER" : "OPTIONS";
+}
+
+/* ============ 抓包与回放 ============ */
+/*
+ * With -C every upstream byte received after PLAY is written to a capture
+ * file exactly as recv() returned it, so replay reproduces the chunking,
+ * in-band messages and oversized frames of the real server.
+ *
+ *   header: "H2RCAP1\n", rtp channel (1), payload type (1),
+ *           URL length (2, big endian), URL
+ *   record: microseconds since the previous record (4), length (4), data
+ */
+#define CAPTURE_MAGIC "H2RCAP1\n"
+
+struct capture {
+    FILE *fp;
+    uint64_t last_us;
+    unsigned long long bytes;
+    char path[256];
+};
+
+static void put_be32(unsigned char *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static uint32_t get_be32(const unsigned char *p) {
+    return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static void capture_write(struct capture *c, const unsigned char *data, int len) {
+    unsigned char hdr[8];
+    uint64_t now = now_us();
+    uint64_t delta = now - c->last_us;
     
-    if (recv_line(rtsp_fd, line, sizeof(line), timeout) <= 0)
-        return -1;
+    if (!c->fp || len <= 0) return;
+    put_be32(hdr, delta > 0xffffffff ? 0xffffffff : (uint32_t)delta);
+    put_be32(hdr + 4, len);
+    c->last_us = now;
+    if (fwrite(hdr, sizeof(hdr), 1, c->fp) != 1 || fwrite(data, len, 1, c->fp) != 1) {
+        LOG("Capture %s: write failed, stopping", c->path);
+        fclose(c->fp);
+        c->fp = NULL;
+        return;
+    }
+    c->bytes += len;
+}
+
+/* Open a capture file in g_capture_dir; bytes already buffered become the first record */
+static struct capture *capture_open(const char *url, int channel, int payload_type,
+                                    const unsigned char *pending, int pending_len) {
+    static unsigned seq = 0;
+    struct capture *c = calloc(1, sizeof(*c));
+    unsigned char hdr[12];
+    int url_len = strlen(url);
+    char stamp[32];
+    time_t t = time(NULL);
     
-    sscanf(line, "RTSP/1.0 %d", &status);
-    LOG("RTSP status: %d ;CSeq: %d", status,cseq);
-    
-    while (recv_line(rtsp_fd, line, sizeof(line), timeout) > 0) {
-        if (line[0] == '\r' && line[1] == '\n') break;
-        
-        if (strncasecmp(line, "Session:", 8) == 0 && session) {
-            char *p = line + 8;
-            while (*p == ' ' || *p == '\t') p++;
-            char *end = strchr(p, ';');
-            if (!end) end = strchr(p, '\r');
-            if (end) {
-                int len = end - p;
-                if (len >= sess_len) len = sess_len - 1;
-                strncpy(session, p, len);
-                session[len] = '\0';
-            }
-        }
-        else if (strncasecmp(line, "Content-Length:", 15) == 0) {
-            *content_length = atoi(line + 15);
-        }
-        else if (strncasecmp(line, "Location:", 9) == 0 && location) {
-            char *p = line + 9;
-            while (*p == ' ' || *p == '\t') p++;
-            char *end = strchr(p, '\r');
-            if (end) {
-                int len = end - p;
-                if (len >= loc_len) len = loc_len - 1;
-                strncpy(location, p, len);
-                location[len] = '\0';
-            }
-        }
+    if (!c) return NULL;
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&t));
+    snprintf(c->path, sizeof(c->path), "%s/%s-%d-%u.cap", g_capture_dir, stamp, getpid(), seq++);
+    if (!(c->fp = fopen(c->path, "wb"))) {
+        PERROR("capture");
+        free(c);
+        return NULL;
     }
+    if (url_len > 0xffff) url_len = 0xffff;
+    memcpy(hdr, CAPTURE_MAGIC, 8);
+    hdr[8] = channel;
+    hdr[9] = payload_type;
+    hdr[10] = url_len >> 8;
+    hdr[11] = url_len & 0xff;
+    fwrite(hdr, sizeof(hdr), 1, c->fp);
+    fwrite(url, url_len, 1, c->fp);
+    LOG("Capturing upstream to %s", c->path);
     
-    return status;
+    c->last_us = now_us();
+    capture_write(c, pending, pending_len);
+    return c;
 }
 
-static void skip_body(int rtsp_fd, int content_length) {
-    char buf[1024];
-    while (content_length > 0) {
-        int n = recv(rtsp_fd, buf, content_length > 1024 ? 1024 : content_length, 0);
-        if (n <= 0) break;
-        content_length -= n;
+static void capture_close(struct capture *c) {
+    if (!c) return;
+    if (c->fp) {
+        LOG("Capture %s: %llu bytes", c->path, c->bytes);
+        fclose(c->fp);
     }
+    free(c);
 }
 
-static int rtsp_setup_play(int rtsp_fd, const char *url, int *rtp_channel, int *rtcp_channel) {
-    char session[256] = "";
-    int cseq = 1;
-    int content_len;
-    char current_url[MAX_URL_LEN];
-    
-    // Convert URL to standard rtsp:// format if needed
-    if (strncmp(url, "rtsp/", 5) == 0) {
-        snprintf(current_url, sizeof(current_url), "rtsp://%s", url + 5);
-        LOG("Converted URL: %s -> %s", url, current_url);
-    } else {
-        strncpy(current_url, url, sizeof(current_url)-1);
-        current_url[sizeof(current_url)-1] = '\0';
-        LOG("Using URL: %s", current_url);
+/*
+ * Per-connection read buffer. RTSP responses, server requests and
+ * interleaved $ frames are all parsed in place from the same byte stream.
+ */
+struct rtsp_reader {
+    unsigned char *buf;
+    int size;
+    int len;                    /* bytes buffered */
+    int off;                    /* start of unparsed data */
+    int skip;                   /* bytes of an oversized frame still to discard */
+    struct capture *cap;        /* -C: record everything read */
+};
+
+enum { RTSP_NEED_MORE = 0, RTSP_MSG_RESPONSE, RTSP_MSG_REQUEST, RTSP_MSG_FRAME };
+#define RTSP_PARSE_ERROR (-1)
+
+struct rtsp_msg {
+    int status;                 /* responses only */
+    int cseq;                   /* -1 if absent */
+    int content_length;
+    char session[256];
+    int session_timeout;        /* seconds, 0 if the server did not say */
+    char location[MAX_URL_LEN];
+    char transport[256];
+    unsigned caps;              /* RTSP_CAP_* from a Public header */
+    int channel;                /* interleaved frames only */
+    const unsigned char *body;  /* points into the reader, valid until the next fill */
+    int body_len;
+};
+
+static void rtsp_reader_init(struct rtsp_reader *rd, unsigned char *buf, int size) {
+    rd->buf = buf;
+    rd->size = size;
+    rd->len = rd->off = rd->skip = 0;
+    rd->cap = NULL;
+}
+
+static void rtsp_reader_reset(struct rtsp_reader *rd) {
+    rd->len = rd->off = rd->skip = 0;
+}
+
+/* Read whatever the socket has into the free tail of the buffer */
+static int rtsp_reader_fill(struct rtsp_reader *rd, int fd) {
+    if (rd->off > 0) {
+        memmove(rd->buf, rd->buf + rd->off, rd->len - rd->off);
+        rd->len -= rd->off;
+        rd->off = 0;
     }
-    
-    LOG("Sending OPTIONS");
-    if (send_rtsp_request(rtsp_fd, "OPTIONS", current_url, NULL, cseq++, NULL) < 0)
-        return -1;
-    if (parse_rtsp_response(rtsp_fd, NULL, 0, &content_len, 5, NULL, 0) != 200)
+    if (rd->len == rd->size) {
+        errno = ENOBUFS;
         return -1;
+    }
+    int n = recv(fd, rd->buf + rd->len, rd->size - rd->len, 0);
+    if (n > 0) {
+        if (rd->cap) capture_write(rd->cap, rd->buf + rd->len, n);
+        rd->len += n;
+    }
+    return n;
+}
+
+/* Parse one CRLF-terminated RTSP header line */
+static void parse_rtsp_header_line(const char *line, struct rtsp_msg *msg) {
+    if (strncasecmp(line, "Session:", 8) == 0) {
+        const char *p = line + 8;
+        while (*p == ' ' || *p == '\t') p++;
+        const char *end = strchr(p, ';');
+        if (!end) end = strchr(p, '\r');
+        if (end) {
+            int len = end - p;
+            if (len >= (int)sizeof(msg->session)) len = sizeof(msg->session) - 1;
+            strncpy(msg->session, p, len);
+            msg->session[len] = '\0';
+        }
+        const char *timeout = strstr(p, ";timeout=");
+        if (timeout) msg->session_timeout = atoi(timeout + 9);
+    }
+    else if (strncasecmp(line, "CSeq:", 5) == 0) {
+        msg->cseq = atoi(line + 5);
+    }
+    else if (strncasecmp(line, "Content-Length:", 15) == 0) {
+        msg->content_length = atoi(line + 15);
+    }
+    else if (strncasecmp(line, "Transport:", 10) == 0) {
+        const char *p = line + 10;
+        while (*p == ' ' || *p == '\t') p++;
+        const char *end = strchr(p, '\r');
+        if (end) {
+            int len = end - p;
+            if (len >= (int)sizeof(msg->transport)) len = sizeof(msg->transport) - 1;
+            strncpy(msg->transport, p, len);
+            msg->transport[len] = '\0';
+        }
+    }
+    else if (strncasecmp(line, "Public:", 7) == 0) {
+        if (strstr(line, "GET_PARAMETER")) msg->caps |= RTSP_CAP_GET_PARAMETER;
+        if (strstr(line, "SET_PARAMETER")) msg->caps |= RTSP_CAP_SET_PARAMETER;
+        msg->caps |= RTSP_CAP_KNOWN;
+    }
+    else if (strncasecmp(line, "Location:", 9) == 0) {
+        const char *p = line + 9;
+        while (*p == ' ' || *p == '\t') p++;
+        const char *end = strchr(p, '\r');
+        if (end) {
+            int len = end - p;
+            if (len >= (int)sizeof(msg->location)) len = sizeof(msg->location) - 1;
+            strncpy(msg->location, p, len);
+            msg->location[len] = '\0';
+        }
+    }
+}
+
+/* Parse a header block that includes its terminating empty line */
+static void parse_rtsp_header_block(const char *hdr, int hdr_len, struct rtsp_msg *msg) {
+    char line[MAX_HEADER_LEN];
+    const char *p = hdr;
+    const char *end = hdr + hdr_len;
     
-    LOG("Sending DESCRIBE");
-    char extra[256];
-    snprintf(extra, sizeof(extra), "Accept: application/sdp\r\n");
-    if (send_rtsp_request(rtsp_fd, "DESCRIBE", current_url, NULL, cseq++, extra) < 0)
-        return -1;
+    msg->status = 0;
+    msg->cseq = -1;
+    msg->content_length = 0;
+    msg->session[0] = '\0';
+    msg->session_timeout = 0;
+    msg->location[0] = '\0';
+    msg->transport[0] = '\0';
+    msg->caps = 0;
     
-    char location[MAX_URL_LEN];
-    int status = parse_rtsp_response(rtsp_fd, NULL, 0, &content_len, 10, location, sizeof(location));
+    sscanf(hdr, "RTSP/1.0 %d", &msg->status);
     
-    // Handle 302 redirect
-    if (status == 302) {
-        LOG("Received 302 redirect to: %s", location);
-        if (location[0] == '\0') {
-            LOG("No Location header in redirect response");
-            return -1;
-        }
-        
-        // For 302 redirect, we need to reconnect to the new server
-        // Close current connection
-        close(rtsp_fd);
-        
-        // Parse redirect URL to get new host and port
-        char new_host[256];
-        int new_port;
-        char new_path[MAX_URL_LEN];
-        if (parse_rtsp_url(location, new_host, &new_port, new_path, sizeof(new_path)) < 0) {
-            LOG("Failed to parse redirect URL");
-            return -1;
-        }
+    while (p < end) {
+        const char *eol = memchr(p, '\n', end - p);
+        if (!eol) break;
+        int len = eol - p + 1;
+        if (len >= (int)sizeof(line)) len = sizeof(line) - 1;
+        memcpy(line, p, len);
+        line[len] = '\0';
+        if (p != hdr)
+            parse_rtsp_header_line(line, msg);
+        p = eol + 1;
+    }
+}
+
+/* Start recording the reader; called right after PLAY, with any frames already buffered */
+static void rtsp_reader_capture(struct rtsp_reader *rd, const char *url, int channel, int payload_type) {
+    if (!g_capture_dir || rd->cap) return;
+    rd->cap = capture_open(url, channel, payload_type, rd->buf + rd->off, rd->len - rd->off);
+}
+
+/*
+ * Yield the next complete message from the buffer.
+ * Returns RTSP_NEED_MORE when more bytes must be read first.
+ */
+static int rtsp_reader_next(struct rtsp_reader *rd, struct rtsp_msg *msg) {
+    while (1) {
+        int avail = rd->len - rd->off;
+        unsigned char *p = rd->buf + rd->off;
         
-        // Connect to new server
-        int new_rtsp_fd = socket(AF_INET, SOCK_STREAM, 0);
-        if (new_rtsp_fd < 0) {
-            LOG("Failed to create socket for redirect");
-            return -1;
+        if (rd->skip > 0) {
+            int n = avail < rd->skip ? avail : rd->skip;
+            rd->off += n;
+            rd->skip -= n;
+            if (rd->skip > 0) return RTSP_NEED_MORE;
+            continue;
         }
+        if (avail == 0) return RTSP_NEED_MORE;
         
-        struct hostent *he = gethostbyname(new_host);
-        if (!he) {
-            LOG("Failed to resolve new host: %s", new_host);
-            close(new_rtsp_fd);
-            return -1;
+        if (p[0] == RTP_INTERLEAVED) {
+            if (avail < 4) return RTSP_NEED_MORE;
+            int length = (p[2] << 8) | p[3];
+            if (length + 4 > rd->size) {
+                LOG("Dropping oversized frame: %d bytes", length);
+                rd->skip = length + 4;
+                continue;
+            }
+            if (avail < length + 4) return RTSP_NEED_MORE;
+            msg->channel = p[1];
+            msg->body = p + 4;
+            msg->body_len = length;
+            rd->off += length + 4;
+            return RTSP_MSG_FRAME;
         }
         
-        struct sockaddr_in new_rtsp_addr;
-        memset(&new_rtsp_addr, 0, sizeof(new_rtsp_addr));
-        new_rtsp_addr.sin_family = AF_INET;
-        new_rtsp_addr.sin_port = htons(new_port);
-        memcpy(&new_rtsp_addr.sin_addr, he->h_addr, he->h_length);
-        
-        struct timeval tv;
-        tv.tv_sec = 10;
-        tv.tv_usec = 0;
-        setsockopt(new_rtsp_fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
-        
-        if (connect(new_rtsp_fd, (struct sockaddr*)&new_rtsp_addr, sizeof(new_rtsp_addr)) < 0) {
-            LOG("Failed to connect to new server: %s:%d", new_host, new_port);
-            close(new_rtsp_fd);
-            return -1;
+        unsigned char *end = memmem(p, avail, "\r\n\r\n", 4);
+        if (!end) {
+            if (avail == rd->size) return RTSP_PARSE_ERROR;
+            return RTSP_NEED_MORE;
         }
+        int hdr_len = end + 4 - p;
+        parse_rtsp_header_block((char*)p, hdr_len, msg);
+        if (msg->content_length < 0 || hdr_len + msg->content_length > rd->size)
+            return RTSP_PARSE_ERROR;
+        if (avail < hdr_len + msg->content_length) return RTSP_NEED_MORE;
         
-        set_tcp_nodelay(new_rtsp_fd);
-        rtsp_fd = new_rtsp_fd;
-        
-        // Update current URL
-        strncpy(current_url, location, sizeof(current_url)-1);
-        LOG("Connected to new server: %s:%d", new_host, new_port);
-        
-        // Restart RTSP flow with new connection
-        cseq = 1;
-        
-        // Send OPTIONS to new server
-        LOG("Sending OPTIONS to new server");
-        if (send_rtsp_request(rtsp_fd, "OPTIONS", current_url, NULL, cseq++, NULL) < 0) {
-            close(rtsp_fd);
-            return -1;
-        }
-        if (parse_rtsp_response(rtsp_fd, NULL, 0, &content_len, 5, NULL, 0) != 200) {
-            close(rtsp_fd);
-            return -1;
+        msg->channel = -1;
+        msg->body = p + hdr_len;
+        msg->body_len = msg->content_length;
+        rd->off += hdr_len + msg->content_length;
+        return strncmp((char*)p, "RTSP/", 5) == 0 ? RTSP_MSG_RESPONSE : RTSP_MSG_REQUEST;
+    }
+}
+
+/*
+ * Wait for the response carrying the given CSeq. Frames, server requests
+ * and stale responses that arrive first are skipped. Returns the status.
+ */
+static int rtsp_read_response(int rtsp_fd, struct rtsp_reader *rd, int cseq,
+                              struct rtsp_msg *msg, int timeout_sec) {
+    fd_set fds;
+    struct timeval tv;
+    
+    while (1) {
+        int r = rtsp_reader_next(rd, msg);
+        if (r == RTSP_PARSE_ERROR) return -1;
+        if (r == RTSP_MSG_RESPONSE) {
+            LOG("RTSP status: %d ;CSeq: %d", msg->status, msg->cseq);
+            if (msg->cseq < 0 || msg->cseq == cseq) return msg->status;
+            LOG("Ignoring response for CSeq %d", msg->cseq);
+            continue;
         }
+        if (r != RTSP_NEED_MORE) continue;
         
-        // Send DESCRIBE to new server
-        LOG("Sending DESCRIBE to new server");
-        if (send_rtsp_request(rtsp_fd, "DESCRIBE", current_url, NULL, cseq++, extra) < 0) {
-            close(rtsp_fd);
-            return -1;
-        }
+        FD_ZERO(&fds);
+        FD_SET(rtsp_fd, &fds);
+        tv.tv_sec = timeout_sec;
+        tv.tv_usec = 0;
         
-        status = parse_rtsp_response(rtsp_fd, NULL, 0, &content_len, 10, NULL, 0);
-        if (status != 200) {
-            LOG("DESCRIBE failed after redirect: %d", status);
-            close(rtsp_fd);
+        if (select(rtsp_fd + 1, &fds, NULL, NULL, &tv) <= 0)
             return -1;
-        }
-    } else if (status != 200) {
-        LOG("DESCRIBE failed: %d", status);
-        return -1;
-    }
-    
-    char *sdp = malloc(content_len + 1);
-    if (!sdp) return -1;
-    
-    int total = 0;
-    while (total < content_len) {
-        int n = recv(rtsp_fd, sdp + total, content_len - total, 0);
-        if (n <= 0) { free(sdp); return -1; }
-        total += n;
+        int n = rtsp_reader_fill(rd, rtsp_fd);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) continue;
+        if (n <= 0) return -1;
     }
-    sdp[content_len] = '\0';
-    LOG("SDP:\n%s", sdp);
-    
-    char control_url[MAX_URL_LEN];
-    strncpy(control_url, current_url, sizeof(control_url)-1);
+}
+
+/* Send a request and wait for its response; returns the status code */
+static int rtsp_transact(int rtsp_fd, struct rtsp_reader *rd, const char *method, const char *url,
+                         const char *session, int *cseq, char *extra_headers,
+                         struct rtsp_msg *msg, int timeout_sec) {
+    LOG("Sending %s", method);
+    uint64_t start = now_ms();
+    int id = (*cseq)++;
+    if (send_rtsp_request(rtsp_fd, method, url, session, id, extra_headers) < 0)
+        return -1;
+    int status = rtsp_read_response(rtsp_fd, rd, id, msg, timeout_sec);
+    LOG("%s took %llu ms", method, (unsigned long long)(now_ms() - start));
+    if (status > 0) stats_observe(stats_method_phase(method), now_ms() - start);
+    return status;
+}
+
+/* Resolve the SETUP target from the SDP a=control attribute */
+static void sdp_control_url(const char *sdp, const char *current_url, char *control_url, int ctrl_len) {
+    strncpy(control_url, current_url, ctrl_len-1);
+    control_url[ctrl_len-1] = '\0';
     
-    char *a = strstr(sdp, "a=control:");
+    const char *a = strstr(sdp, "a=control:");
     if (a) {
         a += 10;
-        char *end = strchr(a, '\n');
+        const char *end = strchr(a, '\n');
         if (end) {
             char ctrl[512];
             int len = end - a;
@@ -470,313 +958,3591 @@ static int rtsp_setup_play(int rtsp_fd, const char *url, int *rtp_channel, int *
                 ctrl[--len] = '\0';
             
             if (strncmp(ctrl, "rtsp://", 7) == 0)
-                strncpy(control_url, ctrl, sizeof(control_url)-1);
+                strncpy(control_url, ctrl, ctrl_len-1);
             else {
                 int url_len = strlen(current_url);
-                if (url_len > sizeof(current_url)-1) url_len = sizeof(current_url)-1;
-                if (current_url[url_len-1] == '/' || ctrl[0] == '/')
-                    snprintf(control_url, sizeof(control_url), "%s%s", current_url, ctrl);
+                if (url_len > 0 && (current_url[url_len-1] == '/' || ctrl[0] == '/'))
+                    snprintf(control_url, ctrl_len, "%s%s", current_url, ctrl);
                 else
-                    snprintf(control_url, sizeof(control_url), "%s/%s", current_url, ctrl);
+                    snprintf(control_url, ctrl_len, "%s/%s", current_url, ctrl);
             }
         }
     }
-    free(sdp);
-    
-    LOG("Sending SETUP for %s", control_url);
-    snprintf(extra, sizeof(extra), "Transport: RTP/AVP/TCP;unicast;interleaved=0-1\r\n");
+}
+
+/* Payload type carrying MP2T: from a=rtpmap, else static 33 on the m= line, else -1 */
+static int sdp_mp2t_payload_type(const char *sdp) {
+    const char *a = sdp;
+    while ((a = strstr(a, "a=rtpmap:")) != NULL) {
+        int pt;
+        char enc[32];
+        a += 9;
+        if (sscanf(a, "%d %31[^/\r\n]", &pt, enc) == 2 && strcasecmp(enc, "MP2T") == 0)
+            return pt;
+    }
     
-    if (send_rtsp_request(rtsp_fd, "SETUP", control_url, NULL, cseq++, extra) < 0)
+    const char *m = strstr(sdp, "m=video");
+    if (!m) m = strstr(sdp, "m=");
+    if (m) {
+        const char *end = strchr(m, '\n');
+        const char *p = strstr(m, "RTP/AVP");
+        while (p && (!end || p < end)) {
+            p = strchr(p, ' ');
+            if (!p || (end && p >= end)) break;
+            p++;
+            if (atoi(p) == RTP_PT_MP2T && *p >= '0' && *p <= '9')
+                return RTP_PT_MP2T;
+        }
+    }
+    return -1;
+}
+
+/* ============ RTP depayloader ============ */
+
+struct rtp_depay {
+    int payload_type;           /* expected PT, -1 accepts any */
+    int have_seq;
+    uint16_t last_seq;
+    uint64_t packets;
+    uint64_t lost;              /* sequence numbers never seen */
+    uint64_t reordered;         /* late or duplicate packets, dropped */
+    uint64_t rejected;          /* malformed or unexpected payload type */
+    uint64_t resyncs;           /* TS sync recovery or sequence restart */
+};
+
+static void rtp_depay_init(struct rtp_depay *d, int payload_type) {
+    memset(d, 0, sizeof(*d));
+    d->payload_type = payload_type;
+}
+
+/* New RTP session on the same channel: forget the sequence, keep the counters */
+static void rtp_depay_restart(struct rtp_depay *d, int payload_type) {
+    d->payload_type = payload_type;
+    d->have_seq = 0;
+}
+
+/* Trim a payload to whole TS packets that start on a sync byte */
+static int ts_align(struct rtp_depay *d, const unsigned char *p, int len, const unsigned char **ts) {
+    int i = 0;
+    
+    if (len > 0 && p[0] != TS_SYNC_BYTE) {
+        while (i < len && !(p[i] == TS_SYNC_BYTE &&
+                            (i + TS_PACKET_SIZE >= len || p[i + TS_PACKET_SIZE] == TS_SYNC_BYTE)))
+            i++;
+        d->resyncs++;
+    }
+    *ts = p + i;
+    return (len - i) / TS_PACKET_SIZE * TS_PACKET_SIZE;
+}
+
+/*
+ * Strip the RTP fixed header, CSRCs, header extension and padding from one
+ * packet and return the aligned MPEG-TS payload length (0 if the packet is
+ * dropped). Raw TS that arrives without RTP framing is passed through.
+ */
+static int rtp_depay(struct rtp_depay *d, const unsigned char *pkt, int len, const unsigned char **ts) {
+    d->packets++;
+    
+    if (len >= TS_PACKET_SIZE && pkt[0] == TS_SYNC_BYTE)
+        return ts_align(d, pkt, len, ts);
+    
+    if (len < RTP_HEADER_LEN || (pkt[0] >> 6) != 2) {
+        d->rejected++;
+        return 0;
+    }
+    
+    int pt = pkt[1] & 0x7f;
+    if (d->payload_type >= 0 && pt != d->payload_type) {
+        d->rejected++;
+        return 0;
+    }
+    
+    int hdr = RTP_HEADER_LEN + (pkt[0] & 0x0f) * 4;
+    if (pkt[0] & 0x10) {
+        if (len < hdr + 4) {
+            d->rejected++;
+            return 0;
+        }
+        hdr += 4 + ((pkt[hdr + 2] << 8) | pkt[hdr + 3]) * 4;
+    }
+    if (pkt[0] & 0x20) len -= pkt[len - 1];
+    if (len <= hdr) {
+        d->rejected++;
+        return 0;
+    }
+    
+    uint16_t seq = (pkt[2] << 8) | pkt[3];
+    if (d->have_seq) {
+        uint16_t delta = seq - d->last_seq;
+        if (delta == 0 || delta >= 0x10000 - RTP_MAX_MISORDER) {
+            d->reordered++;
+            return 0;
+        }
+        if (delta <= RTP_MAX_DROPOUT)
+            d->lost += delta - 1;
+        else
+            d->resyncs++;
+    }
+    d->have_seq = 1;
+    d->last_seq = seq;
+    
+    return ts_align(d, pkt + hdr, len - hdr, ts);
+}
+
+/* ============ RTP over UDP / multicast ============ */
+
+/* Read "name=a-b" (or "name=a") from a Transport header */
+static int transport_param_pair(const char *transport, const char *name, int *a, int *b) {
+    const char *p = transport;
+    int name_len = strlen(name);
+    
+    while ((p = strstr(p, name)) != NULL) {
+        if ((p == transport || p[-1] == ';') && p[name_len] == '=') {
+            *a = atoi(p + name_len + 1);
+            const char *dash = strchr(p + name_len + 1, '-');
+            const char *semi = strchr(p + name_len + 1, ';');
+            *b = (dash && (!semi || dash < semi)) ? atoi(dash + 1) : *a + 1;
+            return 0;
+        }
+        p += name_len;
+    }
+    return -1;
+}
+
+static int transport_param_str(const char *transport, const char *name, char *out, int out_len) {
+    const char *p = transport;
+    int name_len = strlen(name);
+    
+    while ((p = strstr(p, name)) != NULL) {
+        if ((p == transport || p[-1] == ';') && p[name_len] == '=') {
+            p += name_len + 1;
+            int len = strcspn(p, ";");
+            if (len >= out_len) len = out_len - 1;
+            memcpy(out, p, len);
+            out[len] = '\0';
+            return 0;
+        }
+        p += name_len;
+    }
+    return -1;
+}
+
+/* Multicast group from the SDP c= line, if the session is multicast */
+static int sdp_multicast_group(const char *sdp, char *group, int group_len) {
+    const char *c = strstr(sdp, "c=IN IP4 ");
+    struct in_addr addr;
+    
+    if (!c) return -1;
+    c += 9;
+    int len = strcspn(c, "/\r\n ");
+    if (len >= group_len) return -1;
+    memcpy(group, c, len);
+    group[len] = '\0';
+    if (inet_aton(group, &addr) == 0 || !IN_MULTICAST(ntohl(addr.s_addr)))
         return -1;
+    return 0;
+}
+
+struct udp_rx {
+    int rtp_fd;
+    int rtcp_fd;
+    int port;                   /* local RTP port, RTCP is port + 1 */
+    int pooled;                 /* pair taken from the local port pool */
+    uint64_t datagrams;
+    unsigned char *mem;         /* UDP_BATCH receive buffers, then REORDER_SLOTS */
+    int have_next;
+    uint16_t next_seq;
+    int held;
+    int slot_len[REORDER_SLOTS];
+};
+
+typedef void (*ts_sink_fn)(void *ctx, const unsigned char *ts, int len);
+
+static unsigned char g_udp_pairs_used[65536 / 16];
+static int g_udp_port_next = 0;
+
+static void udp_rx_init(struct udp_rx *u) {
+    memset(u, 0, sizeof(*u));
+    u->rtp_fd = u->rtcp_fd = -1;
+}
+
+static int udp_bind(int port, int reuse) {
+    struct sockaddr_in addr;
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) return -1;
     
-    if (parse_rtsp_response(rtsp_fd, session, sizeof(session), &content_len, 10, NULL, 0) != 200) {
-        LOG("SETUP failed");
+    if (reuse) {
+        int yes = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    }
+    int rcvbuf = 1024 * 1024;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
         return -1;
     }
-    skip_body(rtsp_fd, content_len);
-    LOG("Session: %s", session);
+    set_nonblocking(fd);
+    return fd;
+}
+
+static void udp_rx_close(struct udp_rx *u) {
+    if (u->rtp_fd >= 0) close(u->rtp_fd);
+    if (u->rtcp_fd >= 0) close(u->rtcp_fd);
+    if (u->pooled) g_udp_pairs_used[u->port / 16] &= ~(1 << ((u->port / 2) % 8));
+    free(u->mem);
+    udp_rx_init(u);
+}
+
+static int udp_rx_alloc(struct udp_rx *u) {
+    if (!u->mem) u->mem = malloc((UDP_BATCH + REORDER_SLOTS) * UDP_PKT_MAX);
+    return u->mem ? 0 : -1;
+}
+
+/*
+ * Take an even/odd port pair from the configured range. The bitmap tracks
+ * pairs used by this process; bind() catches pairs held by other processes.
+ */
+static int udp_rx_open_unicast(struct udp_rx *u) {
+    int pairs = (g_udp_port_max - g_udp_port_min + 1) / 2;
     
-    *rtp_channel = 0;
-    *rtcp_channel = 1;
+    if (pairs <= 0 || udp_rx_alloc(u) < 0) return -1;
+    if (g_udp_port_next == 0) g_udp_port_next = getpid() % pairs;
     
-    LOG("Sending PLAY");
-    snprintf(extra, sizeof(extra), "Range: npt=0.000-\r\n");
-    if (send_rtsp_request(rtsp_fd, "PLAY", control_url, session, cseq++, extra) < 0)
+    for (int i = 0; i < pairs; i++) {
+        int port = (g_udp_port_min & ~1) + ((g_udp_port_next + i) % pairs) * 2;
+        if (port < g_udp_port_min) continue;
+        if (g_udp_pairs_used[port / 16] & (1 << ((port / 2) % 8))) continue;
+        
+        int rtp = udp_bind(port, 0);
+        if (rtp < 0) continue;
+        int rtcp = udp_bind(port + 1, 0);
+        if (rtcp < 0) {
+            close(rtp);
+            continue;
+        }
+        
+        u->rtp_fd = rtp;
+        u->rtcp_fd = rtcp;
+        u->port = port;
+        u->pooled = 1;
+        g_udp_pairs_used[port / 16] |= 1 << ((port / 2) % 8);
+        g_udp_port_next = (g_udp_port_next + i + 1) % pairs;
+        LOG("UDP port pair %d-%d", port, port + 1);
+        return 0;
+    }
+    LOG("No free UDP port pair in %d-%d", g_udp_port_min, g_udp_port_max);
+    return -1;
+}
+
+static int udp_join(int fd, const char *group) {
+    struct ip_mreq mreq;
+    memset(&mreq, 0, sizeof(mreq));
+    if (inet_aton(group, &mreq.imr_multiaddr) == 0) return -1;
+    mreq.imr_interface.s_addr = INADDR_ANY;
+    return setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq));
+}
+
+/* Bind the ports announced by the server and join the group */
+static int udp_rx_open_multicast(struct udp_rx *u, const char *group, int port) {
+    if (udp_rx_alloc(u) < 0) return -1;
+    u->rtp_fd = udp_bind(port, 1);
+    if (u->rtp_fd < 0 || udp_join(u->rtp_fd, group) < 0) {
+        LOG("Failed to join multicast %s:%d", group, port);
+        udp_rx_close(u);
         return -1;
+    }
+    u->rtcp_fd = udp_bind(port + 1, 1);
+    if (u->rtcp_fd >= 0) udp_join(u->rtcp_fd, group);
+    u->port = port;
+    LOG("Joined multicast %s:%d", group, port);
+    return 0;
+}
+
+/*
+ * Finish transport negotiation from the server's SETUP reply.
+ * Returns 0 when RTP will arrive over UDP, -1 otherwise.
+ */
+static int udp_rx_accept(struct udp_rx *u, const char *transport) {
+    int a, b;
     
-    if (parse_rtsp_response(rtsp_fd, NULL, 0, &content_len, 10, NULL, 0) != 200) {
-        LOG("PLAY failed");
+    if (strstr(transport, "interleaved=")) return -1;
+    if (strstr(transport, "multicast")) {
+        char group[64];
+        if (transport_param_str(transport, "destination", group, sizeof(group)) < 0 ||
+            transport_param_pair(transport, "port", &a, &b) < 0)
+            return -1;
+        if (u->rtp_fd >= 0) udp_rx_close(u);
+        return udp_rx_open_multicast(u, group, a);
+    }
+    if (u->rtp_fd < 0) return -1;
+    if (transport_param_pair(transport, "client_port", &a, &b) == 0 && a != u->port) {
+        LOG("Server changed client_port to %d", a);
+        return -1;
+    }
+    return 0;
+}
+
+static void reorder_emit(struct rtp_depay *d, const unsigned char *pkt, int len,
+                         ts_sink_fn sink, void *ctx) {
+    const unsigned char *ts;
+    int ts_len = rtp_depay(d, pkt, len, &ts);
+    if (ts_len > 0) sink(ctx, ts, ts_len);
+}
+
+/* Emit held packets that are now in sequence */
+static void reorder_drain(struct udp_rx *u, struct rtp_depay *d, ts_sink_fn sink, void *ctx) {
+    unsigned char *slots = u->mem + UDP_BATCH * UDP_PKT_MAX;
+    
+    while (u->held > 0) {
+        int slot = u->next_seq % REORDER_SLOTS;
+        if (u->slot_len[slot] == 0) break;
+        reorder_emit(d, slots + slot * UDP_PKT_MAX, u->slot_len[slot], sink, ctx);
+        u->slot_len[slot] = 0;
+        u->held--;
+        u->next_seq++;
+    }
+}
+
+/* Give up on the missing packet(s): skip ahead to the oldest held one */
+static void reorder_skip(struct udp_rx *u, struct rtp_depay *d, ts_sink_fn sink, void *ctx) {
+    while (u->held > 0 && u->slot_len[u->next_seq % REORDER_SLOTS] == 0)
+        u->next_seq++;
+    reorder_drain(u, d, sink, ctx);
+}
+
+/*
+ * Small sequence-number reorder buffer in front of the depayloader.
+ * Packets ahead of the expected one are held until the gap fills or
+ * REORDER_DEPTH packets are waiting, then the gap is declared lost.
+ */
+static void reorder_push(struct udp_rx *u, struct rtp_depay *d, const unsigned char *pkt, int len,
+                         ts_sink_fn sink, void *ctx) {
+    unsigned char *slots = u->mem + UDP_BATCH * UDP_PKT_MAX;
+    
+    if (len < RTP_HEADER_LEN || (pkt[0] >> 6) != 2) {
+        reorder_emit(d, pkt, len, sink, ctx);
+        return;
+    }
+    
+    uint16_t seq = (pkt[2] << 8) | pkt[3];
+    if (!u->have_next) {
+        u->have_next = 1;
+        u->next_seq = seq;
+    }
+    
+    uint16_t delta = seq - u->next_seq;
+    if (delta == 0) {
+        reorder_emit(d, pkt, len, sink, ctx);
+        u->next_seq++;
+        reorder_drain(u, d, sink, ctx);
+        return;
+    }
+    if (delta >= 0x8000) {
+        /* Already passed: the depayloader counts and drops it */
+        reorder_emit(d, pkt, len, sink, ctx);
+        return;
+    }
+    if (delta >= REORDER_SLOTS) {
+        /* Far ahead (loss burst or restart): flush and resync */
+        while (u->held > 0) reorder_skip(u, d, sink, ctx);
+        reorder_emit(d, pkt, len, sink, ctx);
+        u->next_seq = seq + 1;
+        return;
+    }
+    
+    int slot = seq % REORDER_SLOTS;
+    if (u->slot_len[slot] == 0 && len <= UDP_PKT_MAX) {
+        memcpy(slots + slot * UDP_PKT_MAX, pkt, len);
+        u->slot_len[slot] = len;
+        u->held++;
+    }
+    if (u->held >= REORDER_DEPTH) reorder_skip(u, d, sink, ctx);
+}
+
+/* Receive one batch of datagrams; returns the count, 0 if none, -1 on error */
+static int udp_rx_read(struct udp_rx *u, struct rtp_depay *d, ts_sink_fn sink, void *ctx) {
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iovs[UDP_BATCH];
+    
+    for (int i = 0; i < UDP_BATCH; i++) {
+        iovs[i].iov_base = u->mem + i * UDP_PKT_MAX;
+        iovs[i].iov_len = UDP_PKT_MAX;
+        memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    
+    int n = recvmmsg(u->rtp_fd, msgs, UDP_BATCH, MSG_DONTWAIT, NULL);
+    if (n < 0) return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+    
+    for (int i = 0; i < n; i++) {
+        if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) continue;
+        reorder_push(u, d, u->mem + i * UDP_PKT_MAX, msgs[i].msg_len, sink, ctx);
+    }
+    u->datagrams += n;
+    return n;
+}
+
+/* Negotiated media transport of one RTSP session */
+/* ============ 域名解析与并行连接 ============ */
+/*
+ * Lookups are cached in a MAP_SHARED table, so fork-mode children and the
+ * event loop resolve a head-end name once per TTL. Every resolved address
+ * is tried in Happy Eyeballs order (RFC 8305) under one connect deadline.
+ */
+
+union sockaddr_any {
+    struct sockaddr sa;
+    struct sockaddr_in in;
+    struct sockaddr_in6 in6;
+};
+
+struct dns_result {
+    int naddr;                  /* 0 caches a failed lookup */
+    union sockaddr_any addrs[DNS_MAX_ADDRS];
+};
+
+struct dns_entry {
+    char host[256];
+    uint64_t expires;           /* 0 when the slot is free */
+    uint64_t used;
+    struct dns_result res;
+};
+
+struct dns_cache {
+    volatile int lock;
+    struct dns_entry e[DNS_CACHE_SLOTS];
+};
+
+static struct dns_cache *g_dns_cache = NULL;
+
+/* Shared tables must be mapped before any fork so every process sees them */
+static void *shm_alloc(size_t size) {
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        PERROR("mmap");
+        return NULL;
+    }
+    return p;
+}
+
+/* Critical sections are a few memcpy()s, so spinning is fine */
+static void shm_lock(volatile int *lock) {
+    while (__sync_lock_test_and_set(lock, 1))
+        sched_yield();
+}
+
+static void shm_unlock(volatile int *lock) {
+    __sync_lock_release(lock);
+}
+
+static void dns_cache_lock(void) {
+    shm_lock(&g_dns_cache->lock);
+}
+
+static void dns_cache_unlock(void) {
+    shm_unlock(&g_dns_cache->lock);
+}
+
+/* Returns 1 on a fresh hit, including a cached failure (res->naddr == 0) */
+static int dns_cache_get(const char *host, struct dns_result *res) {
+    uint64_t now = now_ms();
+    int hit = 0;
+    
+    if (!g_dns_cache) return 0;
+    dns_cache_lock();
+    for (int i = 0; i < DNS_CACHE_SLOTS; i++) {
+        struct dns_entry *e = &g_dns_cache->e[i];
+        if (e->expires > now && strcmp(e->host, host) == 0) {
+            *res = e->res;
+            e->used = now;
+            hit = 1;
+            break;
+        }
+    }
+    dns_cache_unlock();
+    return hit;
+}
+
+static void dns_cache_put(const char *host, const struct dns_result *res) {
+    uint64_t now = now_ms();
+    struct dns_entry *slot = NULL;
+    
+    if (!g_dns_cache || strlen(host) >= sizeof(slot->host)) return;
+    dns_cache_lock();
+    for (int i = 0; i < DNS_CACHE_SLOTS; i++) {
+        struct dns_entry *e = &g_dns_cache->e[i];
+        if (strcmp(e->host, host) == 0) {
+            slot = e;
+            break;
+        }
+        /* Otherwise reuse an expired slot, or the least recently used one */
+        if (!slot || (slot->expires > now && (e->expires <= now || e->used < slot->used)))
+            slot = e;
+    }
+    strcpy(slot->host, host);
+    slot->res = *res;
+    slot->used = now;
+    slot->expires = now + (res->naddr ? DNS_CACHE_TTL_SEC : DNS_NEGATIVE_TTL_SEC) * 1000;
+    dns_cache_unlock();
+}
+
+/* Literal addresses never go through the resolver or the cache */
+static int dns_numeric(const char *host, struct dns_result *res) {
+    memset(res, 0, sizeof(*res));
+    if (inet_pton(AF_INET, host, &res->addrs[0].in.sin_addr) == 1) {
+        res->addrs[0].in.sin_family = AF_INET;
+    } else if (inet_pton(AF_INET6, host, &res->addrs[0].in6.sin6_addr) == 1) {
+        res->addrs[0].in6.sin6_family = AF_INET6;
+    } else {
+        return 0;
+    }
+    res->naddr = 1;
+    return 1;
+}
+
+/* Blocking getaddrinfo; alternates families starting with the preferred one */
+static void dns_lookup(const char *host, struct dns_result *res) {
+    struct addrinfo hints, *ai, *p;
+    union sockaddr_any v4[DNS_MAX_ADDRS], v6[DNS_MAX_ADDRS];
+    int n4 = 0, n6 = 0, prefer6 = -1;
+    
+    memset(res, 0, sizeof(*res));
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG;
+    uint64_t start = now_ms();
+    int err = getaddrinfo(host, NULL, &hints, &ai);
+    stats_observe(ST_RESOLVE, now_ms() - start);
+    if (err != 0) return;
+    
+    for (p = ai; p; p = p->ai_next) {
+        if (p->ai_family == AF_INET6 && n6 < DNS_MAX_ADDRS)
+            memcpy(&v6[n6++], p->ai_addr, sizeof(struct sockaddr_in6));
+        else if (p->ai_family == AF_INET && n4 < DNS_MAX_ADDRS)
+            memcpy(&v4[n4++], p->ai_addr, sizeof(struct sockaddr_in));
+        else
+            continue;
+        if (prefer6 < 0) prefer6 = p->ai_family == AF_INET6;
+    }
+    freeaddrinfo(ai);
+    
+    for (int i = 0; i < n4 || i < n6; i++) {
+        if (prefer6 && i < n6 && res->naddr < DNS_MAX_ADDRS) res->addrs[res->naddr++] = v6[i];
+        if (i < n4 && res->naddr < DNS_MAX_ADDRS) res->addrs[res->naddr++] = v4[i];
+        if (!prefer6 && i < n6 && res->naddr < DNS_MAX_ADDRS) res->addrs[res->naddr++] = v6[i];
+    }
+}
+
+/* Cached blocking resolve for fork mode. Returns the number of addresses. */
+static int dns_resolve(const char *host, struct dns_result *res) {
+    if (dns_numeric(host, res) || dns_cache_get(host, res))
+        return res->naddr;
+    dns_lookup(host, res);
+    dns_cache_put(host, res);
+    return res->naddr;
+}
+
+static const char *sockaddr_str(const union sockaddr_any *a, char *buf, size_t len) {
+    if (a->sa.sa_family == AF_INET6)
+        inet_ntop(AF_INET6, &a->in6.sin6_addr, buf, len);
+    else
+        inet_ntop(AF_INET, &a->in.sin_addr, buf, len);
+    return buf;
+}
+
+static int sock_peer_family(int fd) {
+    union sockaddr_any a;
+    socklen_t len = sizeof(a);
+    if (getpeername(fd, &a.sa, &len) < 0) return AF_UNSPEC;
+    return a.sa.sa_family;
+}
+
+/*
+ * Parallel connect: a new attempt starts every CONNECT_RACE_DELAY_MS, or at
+ * once when one fails, and the first socket to connect wins.
+ */
+struct conn_race {
+    struct dns_result res;
+    int fds[DNS_MAX_ADDRS];
+    int next;                   /* next address to try */
+    int pending;                /* attempts in flight */
+    uint64_t start;
+    uint64_t next_at;
+    uint64_t deadline;
+};
+
+static void conn_race_init(struct conn_race *r, const struct dns_result *res, int port) {
+    memset(r, 0, sizeof(*r));
+    if (res) r->res = *res;
+    for (int i = 0; i < DNS_MAX_ADDRS; i++) {
+        r->fds[i] = -1;
+        if (r->res.addrs[i].sa.sa_family == AF_INET6)
+            r->res.addrs[i].in6.sin6_port = htons(port);
+        else
+            r->res.addrs[i].in.sin_port = htons(port);
+    }
+    r->start = r->next_at = now_ms();
+    r->deadline = r->start + RTSP_CONNECT_TIMEOUT_SEC * 1000;
+}
+
+static void conn_race_abort(struct conn_race *r) {
+    for (int i = 0; i < DNS_MAX_ADDRS; i++) {
+        if (r->fds[i] >= 0) close(r->fds[i]);
+        r->fds[i] = -1;
+    }
+    r->pending = 0;
+}
+
+/* Start the next attempt. Returns its slot, or -1 when no address is left. */
+static int conn_race_launch(struct conn_race *r) {
+    char ip[INET6_ADDRSTRLEN];
+    
+    while (r->next < r->res.naddr) {
+        int i = r->next++;
+        union sockaddr_any *a = &r->res.addrs[i];
+        socklen_t len = a->sa.sa_family == AF_INET6 ? sizeof(a->in6) : sizeof(a->in);
+        
+        int fd = socket(a->sa.sa_family, SOCK_STREAM, 0);
+        if (fd < 0) continue;
+        set_nonblocking(fd);
+        LOG("Trying %s", sockaddr_str(a, ip, sizeof(ip)));
+        if (connect(fd, &a->sa, len) < 0 && errno != EINPROGRESS) {
+            LOG("Connect to %s failed: %s", ip, strerror(errno));
+            close(fd);
+            continue;
+        }
+        r->fds[i] = fd;
+        r->pending++;
+        r->next_at = now_ms() + CONNECT_RACE_DELAY_MS;
+        return i;
+    }
+    return -1;
+}
+
+/* When the next attempt or the deadline is due */
+static uint64_t conn_race_wakeup(const struct conn_race *r) {
+    if (r->next < r->res.naddr && r->next_at < r->deadline)
+        return r->next_at;
+    return r->deadline;
+}
+
+/*
+ * Check an attempt that polled writable. Returns the connected socket after
+ * closing the losers, or -1 if this attempt failed.
+ */
+static int conn_race_finish(struct conn_race *r, int i) {
+    char ip[INET6_ADDRSTRLEN];
+    int fd = r->fds[i];
+    int err = 0;
+    socklen_t len = sizeof(err);
+    
+    getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    r->fds[i] = -1;
+    r->pending--;
+    sockaddr_str(&r->res.addrs[i], ip, sizeof(ip));
+    if (err) {
+        LOG("Connect to %s failed: %s", ip, strerror(err));
+        close(fd);
+        r->next_at = now_ms();
         return -1;
     }
-    skip_body(rtsp_fd, content_len);
     
-    return 0;
+    conn_race_abort(r);
+    set_tcp_nodelay(fd);
+    LOG("Connected to %s", ip);
+    stats_observe(ST_CONNECT, now_ms() - r->start);
+    return fd;
+}
+
+/* ============ 换台缓存 ============ */
+/*
+ * What a cold zap learns before SETUP: the redirect target, the control URL
+ * and payload type from the SDP, and the server's OPTIONS capabilities.
+ * A warm zap connects straight to the target and sends SETUP; any failure
+ * drops the entry and the caller starts over cold.
+ */
+
+struct zap_entry {
+    char key[MAX_URL_LEN];          /* normalized request URL */
+    char url[MAX_URL_LEN];          /* after redirects */
+    char control_url[MAX_URL_LEN];
+    int payload_type;
+    int multicast;
+    unsigned caps;
+    uint64_t expires;               /* 0 when the slot is free */
+    uint64_t used;
+};
+
+struct zap_cache {
+    volatile int lock;
+    struct zap_entry e[ZAP_CACHE_SLOTS];
+};
+
+static struct zap_cache *g_zap_cache = NULL;
+
+/* Returns 1 and fills *z on a fresh hit */
+static int zap_cache_get(const char *key, struct zap_entry *z) {
+    uint64_t now = now_ms();
+    int hit = 0;
+    
+    if (!g_zap_cache) return 0;
+    shm_lock(&g_zap_cache->lock);
+    for (int i = 0; i < ZAP_CACHE_SLOTS; i++) {
+        struct zap_entry *e = &g_zap_cache->e[i];
+        if (e->expires > now && strcmp(e->key, key) == 0) {
+            *z = *e;
+            e->used = now;
+            hit = 1;
+            break;
+        }
+    }
+    shm_unlock(&g_zap_cache->lock);
+    return hit;
+}
+
+static void zap_cache_put(const struct zap_entry *z) {
+    uint64_t now = now_ms();
+    struct zap_entry *slot = NULL;
+    
+    if (!g_zap_cache) return;
+    shm_lock(&g_zap_cache->lock);
+    for (int i = 0; i < ZAP_CACHE_SLOTS; i++) {
+        struct zap_entry *e = &g_zap_cache->e[i];
+        if (strcmp(e->key, z->key) == 0) {
+            slot = e;
+            break;
+        }
+        if (!slot || (slot->expires > now && (e->expires <= now || e->used < slot->used)))
+            slot = e;
+    }
+    *slot = *z;
+    slot->used = now;
+    slot->expires = now + ZAP_CACHE_TTL_SEC * 1000;
+    shm_unlock(&g_zap_cache->lock);
+}
+
+static void zap_cache_drop(const char *key) {
+    if (!g_zap_cache) return;
+    shm_lock(&g_zap_cache->lock);
+    for (int i = 0; i < ZAP_CACHE_SLOTS; i++) {
+        struct zap_entry *e = &g_zap_cache->e[i];
+        if (e->expires && strcmp(e->key, key) == 0)
+            e->expires = 0;
+    }
+    shm_unlock(&g_zap_cache->lock);
+}
+
+/* ============ TS 解析 ============ */
+/*
+ * Just enough PSI parsing to find the video PID of the first program and
+ * to tell keyframes and disposable (non-reference) pictures apart.
+ */
+
+enum { TS_OTHER, TS_VIDEO, TS_VIDEO_START, TS_VIDEO_DISPOSABLE, TS_VIDEO_KEY };
+
+struct ts_tracker {
+    int pmt_pid;
+    int video_pid;
+    int video_type;
+    int have_pat, have_pmt;
+    unsigned char pat[TS_PACKET_SIZE];
+    unsigned char pmt[TS_PACKET_SIZE];
+};
+
+static void ts_tracker_init(struct ts_tracker *t) {
+    memset(t, 0, sizeof(*t));
+    t->pmt_pid = -1;
+    t->video_pid = -1;
+}
+
+static int ts_pid(const unsigned char *pkt) {
+    return ((pkt[1] & 0x1f) << 8) | pkt[2];
+}
+
+/* Offset of the payload in a TS packet, or -1 if it has none */
+static int ts_payload(const unsigned char *pkt) {
+    int off = 4;
+    if (!(pkt[3] & 0x10)) return -1;
+    if (pkt[3] & 0x20) off += 1 + pkt[4];
+    return off < TS_PACKET_SIZE ? off : -1;
+}
+
+/* Start of the PSI section in a packet that begins one, or NULL */
+static const unsigned char *ts_section(const unsigned char *pkt, int *len) {
+    int off = ts_payload(pkt);
+    if (off < 0 || !(pkt[1] & 0x40)) return NULL;
+    off += 1 + pkt[off];        /* pointer_field */
+    if (off + 3 > TS_PACKET_SIZE) return NULL;
+    int sec_len = 3 + (((pkt[off + 1] & 0x0f) << 8) | pkt[off + 2]);
+    if (off + sec_len > TS_PACKET_SIZE) return NULL;
+    *len = sec_len;
+    return pkt + off;
+}
+
+static void ts_track_psi(struct ts_tracker *t, const unsigned char *pkt, int pid) {
+    const unsigned char *sec;
+    int len, i;
+    
+    if (!(sec = ts_section(pkt, &len))) return;
+    if (pid == 0 && sec[0] == 0x00) {
+        /* PAT: take the first real program */
+        for (i = 8; i + 4 <= len - 4; i += 4) {
+            if (((sec[i] << 8) | sec[i + 1]) == 0) continue;
+            t->pmt_pid = ((sec[i + 2] & 0x1f) << 8) | sec[i + 3];
+            memcpy(t->pat, pkt, TS_PACKET_SIZE);
+            t->have_pat = 1;
+            break;
+        }
+    } else if (pid == t->pmt_pid && sec[0] == 0x02 && len >= 16) {
+        /* PMT: take the first video elementary stream */
+        for (i = 12 + (((sec[10] & 0x0f) << 8) | sec[11]); i + 5 <= len - 4;
+             i += 5 + (((sec[i + 3] & 0x0f) << 8) | sec[i + 4])) {
+            int type = sec[i];
+            if (type == 0x01 || type == 0x02 || type == 0x1b || type == 0x24) {
+                t->video_type = type;
+                t->video_pid = ((sec[i + 1] & 0x1f) << 8) | sec[i + 2];
+                break;
+            }
+        }
+        memcpy(t->pmt, pkt, TS_PACKET_SIZE);
+        t->have_pmt = 1;
+    }
+}
+
+/*
+ * Classify a packet against the tracked video PID. A video PES starts a
+ * keyframe if the random access indicator is set or it carries an H.264/H.265
+ * IDR, a parameter set or an MPEG-2 sequence header. It is disposable if its
+ * first picture is not used for reference (H.264 nal_ref_idc 0, H.265
+ * sub-layer non-reference, MPEG-2 B picture). Only the first packet of a PES
+ * is inspected, so a picture whose slice starts later counts as TS_VIDEO_START.
+ */
+static int ts_classify(const struct ts_tracker *t, const unsigned char *pkt) {
+    if (ts_pid(pkt) != t->video_pid) return TS_OTHER;
+    if ((pkt[3] & 0x20) && pkt[4] > 0 && (pkt[5] & 0x40)) return TS_VIDEO_KEY;
+    if (!(pkt[1] & 0x40)) return TS_VIDEO;
+    
+    int off = ts_payload(pkt);
+    if (off < 0 || off + 9 > TS_PACKET_SIZE) return TS_VIDEO_START;
+    const unsigned char *p = pkt + off;
+    if (p[0] != 0 || p[1] != 0 || p[2] != 1 || (p[3] & 0xf0) != 0xe0) return TS_VIDEO_START;
+    
+    for (int i = off + 9 + p[8]; i + 4 <= TS_PACKET_SIZE; i++) {
+        if (pkt[i] != 0 || pkt[i + 1] != 0 || pkt[i + 2] != 1) continue;
+        int b = pkt[i + 3];
+        if (t->video_type == 0x1b) {
+            int type = b & 0x1f;
+            if (type == 5 || type == 7) return TS_VIDEO_KEY;
+            if (type == 1) return (b & 0x60) ? TS_VIDEO_START : TS_VIDEO_DISPOSABLE;
+        } else if (t->video_type == 0x24) {
+            int type = (b >> 1) & 0x3f;
+            if ((type >= 16 && type <= 21) || type == 32 || type == 33) return TS_VIDEO_KEY;
+            if (type <= 14) return (type & 1) ? TS_VIDEO_START : TS_VIDEO_DISPOSABLE;
+        } else {
+            if (b == 0xb3) return TS_VIDEO_KEY;
+            if (b == 0x00 && i + 5 < TS_PACKET_SIZE)
+                return ((pkt[i + 5] >> 3) & 7) == 3 ? TS_VIDEO_DISPOSABLE : TS_VIDEO_START;
+        }
+    }
+    return TS_VIDEO_START;
+}
+
+/* Follow PAT/PMT changes in 188-byte aligned TS */
+static void ts_track(struct ts_tracker *t, const unsigned char *ts, int len) {
+    for (int off = 0; off + TS_PACKET_SIZE <= len; off += TS_PACKET_SIZE) {
+        int pid = ts_pid(ts + off);
+        if (pid == 0 || pid == t->pmt_pid) ts_track_psi(t, ts + off, pid);
+    }
+}
+
+/* ============ 关键帧缓存 (GOP) ============ */
+/*
+ * Every active relay publishes the TS packets since its latest keyframe,
+ * plus the current PAT and PMT, into a slot of a shared pool. A new viewer
+ * of a live channel gets that burst first, so the picture appears without
+ * waiting for the next keyframe. The pool size is set with -G. Each slot
+ * bounds one channel's GOP, and slots are recycled least recently used first.
+ */
+
+struct gop_slot {
+    volatile int lock;
+    char key[MAX_URL_LEN];      /* empty when free */
+    uint32_t gen;               /* bumped whenever the slot changes owner */
+    uint64_t claimed;
+    uint64_t updated;           /* last publish */
+    uint64_t used;              /* last claim or burst, for LRU */
+    int valid;                  /* data starts at a keyframe and PSI is known */
+    int len;
+    unsigned char pat[TS_PACKET_SIZE];
+    unsigned char pmt[TS_PACKET_SIZE];
+};
+
+struct gop_pool {
+    volatile int lock;          /* taken before any slot lock */
+    int nslots;
+    struct gop_slot slots[];    /* followed by nslots * GOP_SLOT_SIZE bytes of data */
+};
+
+/* Publishing state of one relay */
+struct gop_writer {
+    const char *key;
+    int slot;                   /* -1 when not publishing */
+    uint32_t gen;
+};
+
+static struct gop_pool *g_gop_pool = NULL;
+
+static void gop_pool_init(int total) {
+    int nslots = total / GOP_SLOT_SIZE;
+    size_t hdr = (sizeof(struct gop_pool) + nslots * sizeof(struct gop_slot) + 15) & ~(size_t)15;
+    
+    if (nslots == 0) return;
+    g_gop_pool = shm_alloc(hdr + (size_t)nslots * GOP_SLOT_SIZE);
+    if (g_gop_pool) g_gop_pool->nslots = nslots;
+}
+
+static unsigned char *gop_data(int slot) {
+    size_t hdr = (sizeof(struct gop_pool) + g_gop_pool->nslots * sizeof(struct gop_slot) + 15) & ~(size_t)15;
+    return (unsigned char*)g_gop_pool + hdr + (size_t)slot * GOP_SLOT_SIZE;
+}
+
+static void gop_writer_init(struct gop_writer *w, const char *key) {
+    memset(w, 0, sizeof(*w));
+    w->key = key;
+    w->slot = -1;
+}
+
+/* Free and abandoned slots first, then live ones by LRU */
+static int gop_slot_rank(const struct gop_slot *s, uint64_t now) {
+    if (!s->key[0] || now - s->updated >= GOP_FRESH_MS) return 2;
+    return now - s->claimed >= GOP_MIN_HOLD_MS ? 1 : 0;
+}
+
+/*
+ * Take a slot for the writer's channel: its own stale one, a free one, or
+ * the least recently used live one. A live slot is held at least
+ * GOP_MIN_HOLD_MS so more channels than slots do not evict each other at
+ * every keyframe. Returns -1 if nothing can be taken, or while another
+ * relay of the same channel is publishing.
+ */
+static int gop_claim(struct gop_writer *w) {
+    uint64_t now = now_ms();
+    int pick = -1, best = 0;
+    
+    shm_lock(&g_gop_pool->lock);
+    for (int i = 0; i < g_gop_pool->nslots; i++) {
+        struct gop_slot *s = &g_gop_pool->slots[i];
+        if (strcmp(s->key, w->key) == 0) {
+            pick = now - s->updated < GOP_FRESH_MS ? -1 : i;
+            break;
+        }
+        int rank = gop_slot_rank(s, now);
+        if (rank > best || (rank == best && rank > 0 && s->used < g_gop_pool->slots[pick].used)) {
+            pick = i;
+            best = rank;
+        }
+    }
+    if (pick >= 0) {
+        struct gop_slot *s = &g_gop_pool->slots[pick];
+        shm_lock(&s->lock);
+        if (s->key[0] && strcmp(s->key, w->key) != 0)
+            LOG("GOP cache full, evicting %s", s->key);
+        strcpy(s->key, w->key);
+        w->gen = ++s->gen;
+        s->claimed = now;
+        s->used = now;
+        s->updated = now;
+        s->valid = 0;
+        s->len = 0;
+        shm_unlock(&s->lock);
+    }
+    shm_unlock(&g_gop_pool->lock);
+    return w->slot = pick;
+}
+
+/* Feed 188-byte aligned TS from the relay path, after ts_track() has seen it */
+static void gop_publish(struct gop_writer *w, const struct ts_tracker *t,
+                        const unsigned char *ts, int len) {
+    struct gop_slot *s = NULL;
+    unsigned char *data = NULL;
+    
+    if (!g_gop_pool || !w->key) return;
+    
+    for (int off = 0; off + TS_PACKET_SIZE <= len; off += TS_PACKET_SIZE) {
+        const unsigned char *pkt = ts + off;
+        
+        if (ts_classify(t, pkt) == TS_VIDEO_KEY) {
+            if (!s && w->slot < 0 && w->key[0] && gop_claim(w) < 0) continue;
+            if (!s) {
+                s = &g_gop_pool->slots[w->slot];
+                data = gop_data(w->slot);
+                shm_lock(&s->lock);
+            }
+            if (s->gen != w->gen) goto lost;
+            s->len = 0;
+            s->valid = t->have_pat && t->have_pmt;
+            memcpy(s->pat, t->pat, TS_PACKET_SIZE);
+            memcpy(s->pmt, t->pmt, TS_PACKET_SIZE);
+        } else if (!s) {
+            if (w->slot < 0) continue;
+            s = &g_gop_pool->slots[w->slot];
+            data = gop_data(w->slot);
+            shm_lock(&s->lock);
+            if (s->gen != w->gen) goto lost;
+        }
+        
+        if (!s->valid) continue;
+        if (s->len + TS_PACKET_SIZE > GOP_SLOT_SIZE) {
+            LOG("GOP of %s exceeds %d KB, not cached", w->key, GOP_SLOT_SIZE / 1024);
+            s->valid = 0;
+            continue;
+        }
+        memcpy(data + s->len, pkt, TS_PACKET_SIZE);
+        s->len += TS_PACKET_SIZE;
+    }
+    if (s) {
+        s->updated = now_ms();
+        shm_unlock(&s->lock);
+    }
+    return;
+    
+lost:
+    /* Evicted by another channel; try again at the next keyframe */
+    shm_unlock(&s->lock);
+    w->slot = -1;
+}
+
+static void gop_writer_release(struct gop_writer *w) {
+    if (!g_gop_pool || w->slot < 0) return;
+    struct gop_slot *s = &g_gop_pool->slots[w->slot];
+    shm_lock(&g_gop_pool->lock);
+    shm_lock(&s->lock);
+    if (s->gen == w->gen) {
+        s->key[0] = '\0';
+        s->valid = 0;
+    }
+    shm_unlock(&s->lock);
+    shm_unlock(&g_gop_pool->lock);
+    w->slot = -1;
+}
+
+/*
+ * Copy PAT, PMT and the cached GOP of a live channel into a new buffer.
+ * Returns the length, or 0 when there is nothing fresh to send.
+ */
+static int gop_snapshot(const char *key, unsigned char **out) {
+    uint64_t now = now_ms();
+    int len = 0;
+    
+    if (!g_gop_pool) return 0;
+    shm_lock(&g_gop_pool->lock);
+    for (int i = 0; i < g_gop_pool->nslots; i++) {
+        struct gop_slot *s = &g_gop_pool->slots[i];
+        if (strcmp(s->key, key) != 0) continue;
+        shm_lock(&s->lock);
+        if (s->valid && s->len > 0 && now - s->updated < GOP_FRESH_MS &&
+            (*out = malloc(2 * TS_PACKET_SIZE + s->len)) != NULL) {
+            memcpy(*out, s->pat, TS_PACKET_SIZE);
+            memcpy(*out + TS_PACKET_SIZE, s->pmt, TS_PACKET_SIZE);
+            memcpy(*out + 2 * TS_PACKET_SIZE, gop_data(i), s->len);
+            len = 2 * TS_PACKET_SIZE + s->len;
+            s->used = now;
+        }
+        shm_unlock(&s->lock);
+        break;
+    }
+    shm_unlock(&g_gop_pool->lock);
+    return len;
+}
+
+/* ============ 观众输出队列 ============ */
+/*
+ * A viewer reads the channel ring through its own cursor, and the bytes
+ * between cursor and head are its output queue. Depth is measured in
+ * milliseconds of media at the channel bitrate. Past half of -Q the viewer
+ * loses disposable pictures, past -Q all video until the next keyframe.
+ * PSI and audio always go through. Drops are whole PES, so the stream stays
+ * decodable and the relay never waits for a slow client.
+ * Fork mode uses the same code with one ring per client.
+ */
+
+/* Packet ring: one writer, every viewer keeps its own read cursor */
+struct ring {
+    unsigned char *data;
+    int size;
+    uint64_t head;              /* total bytes ever written */
+};
+
+static void ring_write(struct ring *r, const unsigned char *p, int len) {
+    if (len > r->size) {
+        r->head += len - r->size;
+        p += len - r->size;
+        len = r->size;
+    }
+    int off = r->head % r->size;
+    int first = r->size - off < len ? r->size - off : len;
+    memcpy(r->data + off, p, first);
+    memcpy(r->data, p + first, len - first);
+    r->head += len;
+}
+
+/* Describe the bytes between pos and the write head; returns the iovec count */
+static int ring_iov(const struct ring *r, uint64_t pos, struct iovec *iov) {
+    int avail = r->head - pos;
+    int off = pos % r->size;
+    int first = r->size - off;
+    
+    if (avail == 0) return 0;
+    iov[0].iov_base = r->data + off;
+    if (avail <= first) {
+        iov[0].iov_len = avail;
+        return 1;
+    }
+    iov[0].iov_len = first;
+    iov[1].iov_base = r->data;
+    iov[1].iov_len = avail - first;
+    return 2;
+}
+
+/* Copy len bytes starting at pos, which must still be in the ring */
+static void ring_copy(const struct ring *r, uint64_t pos, unsigned char *out, int len) {
+    int off = pos % r->size;
+    int first = r->size - off < len ? r->size - off : len;
+    memcpy(out, r->data + off, first);
+    memcpy(out + first, r->data, len - first);
+}
+
+/* Channel bitrate in bytes per second, smoothed over a few seconds */
+struct rate_est {
+    uint64_t start;
+    uint64_t bytes;
+    uint32_t rate;
+};
+
+static void rate_update(struct rate_est *e, int len) {
+    uint64_t now = now_ms();
+    
+    if (!e->start) e->start = now;
+    e->bytes += len;
+    if (now - e->start >= 1000) {
+        uint32_t cur = e->bytes * 1000 / (now - e->start);
+        e->rate = e->rate ? (e->rate * 3 + cur) / 4 : cur;
+        e->start = now;
+        e->bytes = 0;
+    }
+}
+
+/* Depayloaded TS of one channel, as seen by its viewers */
+struct media_ring {
+    struct ring ring;
+    struct ts_tracker ts;
+    struct rate_est rate;
+};
+
+static void media_ring_write(struct media_ring *m, const unsigned char *ts, int len) {
+    ts_track(&m->ts, ts, len);
+    rate_update(&m->rate, len);
+    ring_write(&m->ring, ts, len);
+}
+
+enum { VQ_PASS, VQ_SKIP_DISPOSABLE, VQ_WAIT_KEY };
+
+struct viewer_queue {
+    char name[32];              /* for logs */
+    uint64_t pos;               /* read cursor into the ring */
+    int mode;
+    int dropping;               /* the current video PES is being dropped */
+    int blocked;                /* the socket is full */
+    unsigned char *pend;        /* sent before ring data: GOP burst or filtered packets */
+    int pend_len, pend_off, pend_cap;
+    uint64_t last_sent;
+    uint64_t since;             /* request time until the first byte is out */
+    uint32_t depth_ms, max_depth_ms;
+    uint64_t drops;             /* TS packets */
+    uint64_t stalls;            /* times the socket filled up */
+};
+
+static void vq_init(struct viewer_queue *q, const struct sockaddr_in *addr, uint64_t pos,
+                    uint64_t since) {
+    memset(q, 0, sizeof(*q));
+    snprintf(q->name, sizeof(q->name), "%s:%d", inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
+    q->pos = pos;
+    q->since = since;
+    q->last_sent = now_ms();
+}
+
+static void vq_sent(struct viewer_queue *q) {
+    q->last_sent = now_ms();
+    if (q->since) {
+        stats_observe(ST_FIRST_BYTE, q->last_sent - q->since);
+        q->since = 0;
+    }
+}
+
+static void vq_free(struct viewer_queue *q) {
+    if (q->max_depth_ms || q->drops || q->stalls)
+        LOG("Viewer %s: queue peaked at %u ms, %llu packets dropped, %llu stalls", q->name,
+            q->max_depth_ms, (unsigned long long)q->drops, (unsigned long long)q->stalls);
+    free(q->pend);
+    q->pend = NULL;
+    q->pend_len = q->pend_off = q->pend_cap = 0;
+}
+
+/* Stuck on a full socket for too long */
+static int vq_stalled(const struct viewer_queue *q) {
+    return q->blocked && now_ms() - q->last_sent >= VIEWER_STALL_TIMEOUT_SEC * 1000;
+}
+
+/*
+ * The upstream session was re-established under this viewer. The ring only
+ * ever holds whole TS packets, so the new stream joins on a packet boundary;
+ * video is held back until its first keyframe so the decoder does not see
+ * the cut picture run into the middle of another.
+ */
+static void vq_splice(struct viewer_queue *q) {
+    LOG("Viewer %s: upstream resumed, waiting for a keyframe", q->name);
+    q->mode = VQ_WAIT_KEY;
+    q->dropping = 1;
+}
+
+static void vq_update(struct viewer_queue *q, uint64_t lag, uint32_t rate) {
+    q->depth_ms = rate ? lag * 1000 / rate : 0;
+    if (q->depth_ms > q->max_depth_ms) q->max_depth_ms = q->depth_ms;
+    
+    if (q->depth_ms > (uint32_t)g_queue_ms) {
+        if (q->mode != VQ_WAIT_KEY)
+            LOG("Viewer %s is %u ms behind, dropping video until the next keyframe",
+                q->name, q->depth_ms);
+        q->mode = VQ_WAIT_KEY;
+    } else if (q->mode == VQ_PASS && q->depth_ms > (uint32_t)g_queue_ms / 2) {
+        q->mode = VQ_SKIP_DISPOSABLE;
+    } else if (q->mode == VQ_SKIP_DISPOSABLE && q->depth_ms < (uint32_t)g_queue_ms / 4) {
+        q->mode = VQ_PASS;
+    }
+}
+
+/* Drop decisions are taken where a video PES starts and hold until the next one */
+static int vq_keep(struct viewer_queue *q, int cls) {
+    switch (cls) {
+    case TS_OTHER:
+        return 1;
+    case TS_VIDEO_KEY:
+        if (q->mode == VQ_WAIT_KEY && q->depth_ms <= (uint32_t)g_queue_ms / 2) {
+            LOG("Viewer %s resynced at a keyframe", q->name);
+            q->mode = q->depth_ms < (uint32_t)g_queue_ms / 4 ? VQ_PASS : VQ_SKIP_DISPOSABLE;
+        }
+        q->dropping = q->mode == VQ_WAIT_KEY;
+        break;
+    case TS_VIDEO_START:
+        q->dropping = q->mode == VQ_WAIT_KEY;
+        break;
+    case TS_VIDEO_DISPOSABLE:
+        q->dropping = q->mode != VQ_PASS;
+        break;
+    }
+    if (q->dropping) q->drops++;
+    return !q->dropping;
+}
+
+/* Make room for filtered packets; the pending buffer must be empty */
+static int vq_reserve(struct viewer_queue *q) {
+    if (q->pend_cap >= VQ_STAGE_PACKETS * TS_PACKET_SIZE) return 0;
+    free(q->pend);
+    q->pend_cap = 0;
+    if (!(q->pend = malloc(VQ_STAGE_PACKETS * TS_PACKET_SIZE))) return -1;
+    q->pend_cap = VQ_STAGE_PACKETS * TS_PACKET_SIZE;
+    return 0;
+}
+
+/* Copy the packets this viewer keeps from the ring into its pending buffer */
+static void vq_stage(struct viewer_queue *q, const struct media_ring *m) {
+    const struct ring *r = &m->ring;
+    
+    if (vq_reserve(q) < 0) {
+        q->pos = r->head;
+        return;
+    }
+    
+    /* Finish a packet that a plain write left half sent */
+    int part = q->pos % TS_PACKET_SIZE;
+    if (part) {
+        ring_copy(r, q->pos, q->pend, TS_PACKET_SIZE - part);
+        q->pend_len = TS_PACKET_SIZE - part;
+        q->pos += TS_PACKET_SIZE - part;
+    }
+    
+    while (q->pos != r->head && q->pend_len + TS_PACKET_SIZE <= q->pend_cap) {
+        unsigned char *pkt = q->pend + q->pend_len;
+        ring_copy(r, q->pos, pkt, TS_PACKET_SIZE);
+        q->pos += TS_PACKET_SIZE;
+        if (vq_keep(q, ts_classify(&m->ts, pkt)))
+            q->pend_len += TS_PACKET_SIZE;
+    }
+}
+
+/*
+ * Send what the viewer can take without blocking. A viewer that keeps up
+ * is served straight from the ring with writev(); one that is behind goes
+ * packet by packet through the drop policy. Returns -1 on a socket error,
+ * 1 while data is left, 0 once caught up.
+ */
+static int vq_flush(int fd, struct viewer_queue *q, const struct media_ring *m) {
+    const struct ring *r = &m->ring;
+    
+    while (1) {
+        while (q->pend_off < q->pend_len) {
+            int n = send(fd, q->pend + q->pend_off, q->pend_len - q->pend_off, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) goto blocked;
+                return -1;
+            }
+            q->pend_off += n;
+            vq_sent(q);
+        }
+        q->pend_len = q->pend_off = 0;
+        if (q->pos == r->head) break;
+        
+        uint64_t lag = r->head - q->pos;
+        if (lag > (uint64_t)r->size) {
+            /* The unsent data is overwritten: pad out the broken packet and restart live */
+            int part = q->pos % TS_PACKET_SIZE;
+            LOG("Viewer %s fell %llu bytes behind, skipping to live", q->name,
+                (unsigned long long)lag);
+            q->drops += lag / TS_PACKET_SIZE;
+            q->pos = r->head;
+            q->mode = VQ_WAIT_KEY;
+            q->dropping = 1;
+            if (part && vq_reserve(q) == 0) {
+                memset(q->pend, 0xff, TS_PACKET_SIZE - part);
+                q->pend_len = TS_PACKET_SIZE - part;
+            }
+            continue;
+        }
+        
+        /* Bytes still in the socket are as late as those in the ring */
+        int outq = 0;
+        ioctl(fd, SIOCOUTQ, &outq);
+        vq_update(q, lag + outq, m->rate.rate);
+        if (q->mode != VQ_PASS || q->dropping) {
+            vq_stage(q, m);
+            continue;
+        }
+        
+        struct iovec iov[2];
+        int n = writev(fd, iov, ring_iov(r, q->pos, iov));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) goto blocked;
+            return -1;
+        }
+        q->pos += n;
+        vq_sent(q);
+    }
+    q->blocked = 0;
+    return 0;
+    
+blocked:
+    if (!q->blocked) {
+        q->blocked = 1;
+        q->stalls++;
+    }
+    return 1;
+}
+
+struct rtsp_stream {
+    int rtp_channel;            /* interleaved channels when udp.rtp_fd < 0 */
+    int rtcp_channel;
+    int payload_type;
+    int force_tcp;
+    char control_url[MAX_URL_LEN];
+    char session[256];
+    int session_timeout;
+    int cseq;                   /* next CSeq on the session */
+    unsigned caps;
+    uint64_t next_keepalive;
+    struct udp_rx udp;
+    struct rtp_depay depay;
+    struct gop_writer gop;
+    struct stats_session *stats;
+    struct media_ring media;    /* output queue of the client */
+    struct viewer_queue out;
+};
+
+/*
+ * Connect used by fork mode: races every resolved address, then hands back
+ * a blocking socket. Returns -1 on connect failure, -2 if the host does not
+ * resolve.
+ */
+static int rtsp_connect(const char *host, int port) {
+    struct dns_result res;
+    struct conn_race race;
+    struct pollfd pfd[DNS_MAX_ADDRS];
+    int slot[DNS_MAX_ADDRS];
+    
+    if (dns_resolve(host, &res) == 0) {
+        LOG("Failed to resolve host: %s", host);
+        return -2;
+    }
+    
+    conn_race_init(&race, &res, port);
+    while (1) {
+        uint64_t now = now_ms();
+        if (now >= race.deadline) break;
+        if ((race.pending == 0 || now >= race.next_at) &&
+            conn_race_launch(&race) < 0 && race.pending == 0)
+            break;
+        
+        int n = 0;
+        for (int i = 0; i < DNS_MAX_ADDRS; i++) {
+            if (race.fds[i] < 0) continue;
+            pfd[n].fd = race.fds[i];
+            pfd[n].events = POLLOUT;
+            slot[n++] = i;
+        }
+        uint64_t wake = conn_race_wakeup(&race);
+        if (poll(pfd, n, wake > now ? (int)(wake - now) : 0) < 0 && errno != EINTR)
+            break;
+        
+        for (int i = 0; i < n; i++) {
+            if (!pfd[i].revents) continue;
+            int fd = conn_race_finish(&race, slot[i]);
+            if (fd >= 0) {
+                struct timeval tv;
+                tv.tv_sec = 10;
+                tv.tv_usec = 0;
+                setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+                return fd;
+            }
+        }
+    }
+    
+    LOG("Failed to connect to %s:%d", host, port);
+    conn_race_abort(&race);
+    return -1;
+}
+
+/*
+ * Run the RTSP handshake up to PLAY. A warm zap (zap->url set) skips straight
+ * to SETUP; after a cold one *zap holds what the next zap can reuse.
+ */
+static int rtsp_setup_play(int *rtsp_fd, struct rtsp_reader *rd, const char *url,
+                           struct rtsp_stream *st, struct zap_entry *zap) {
+    struct rtsp_msg msg;
+    char session[256] = "";
+    int cseq = 1;
+    char current_url[MAX_URL_LEN];
+    char extra[256];
+    char *control_url = zap->control_url;
+    int multicast;
+    
+    if (zap->url[0]) {
+        LOG("Warm zap: SETUP %s", zap->control_url);
+        st->payload_type = zap->payload_type;
+        multicast = zap->multicast;
+        goto setup;
+    }
+    
+    // Convert URL to standard rtsp:// format if needed
+    if (strncmp(url, "rtsp/", 5) == 0) {
+        snprintf(current_url, sizeof(current_url), "rtsp://%s", url + 5);
+        LOG("Converted URL: %s -> %s", url, current_url);
+    } else {
+        strncpy(current_url, url, sizeof(current_url)-1);
+        current_url[sizeof(current_url)-1] = '\0';
+        LOG("Using URL: %s", current_url);
+    }
+    
+    if (rtsp_transact(*rtsp_fd, rd, "OPTIONS", current_url, NULL, &cseq, NULL, &msg, 5) != 200)
+        return -1;
+    zap->caps = msg.caps;
+    
+    snprintf(extra, sizeof(extra), "Accept: application/sdp\r\n");
+    int status = rtsp_transact(*rtsp_fd, rd, "DESCRIBE", current_url, NULL, &cseq, extra, &msg, 10);
+    
+    // Handle 302 redirect
+    if (status == 302) {
+        char location[MAX_URL_LEN];
+        strcpy(location, msg.location);
+        LOG("Received 302 redirect to: %s", location);
+        if (location[0] == '\0') {
+            LOG("No Location header in redirect response");
+            return -1;
+        }
+        
+        // For 302 redirect, we need to reconnect to the new server
+        // Close current connection
+        close(*rtsp_fd);
+        *rtsp_fd = -1;
+        rtsp_reader_reset(rd);
+        
+        // Parse redirect URL to get new host and port
+        char new_host[256];
+        int new_port;
+        char new_path[MAX_URL_LEN];
+        if (parse_rtsp_url(location, new_host, &new_port, new_path, sizeof(new_path)) < 0) {
+            LOG("Failed to parse redirect URL");
+            return -1;
+        }
+        
+        // Connect to new server
+        int new_rtsp_fd = rtsp_connect(new_host, new_port);
+        if (new_rtsp_fd < 0) {
+            LOG("Failed to connect to new server: %s:%d", new_host, new_port);
+            return -1;
+        }
+        *rtsp_fd = new_rtsp_fd;
+        
+        // Update current URL
+        strncpy(current_url, location, sizeof(current_url)-1);
+        LOG("Connected to new server: %s:%d", new_host, new_port);
+        
+        // Restart RTSP flow with new connection
+        cseq = 1;
+        
+        // Send OPTIONS to new server
+        if (rtsp_transact(*rtsp_fd, rd, "OPTIONS", current_url, NULL, &cseq, NULL, &msg, 5) != 200)
+            return -1;
+        zap->caps = msg.caps;
+        
+        // Send DESCRIBE to new server
+        status = rtsp_transact(*rtsp_fd, rd, "DESCRIBE", current_url, NULL, &cseq, extra, &msg, 10);
+        if (status != 200) {
+            LOG("DESCRIBE failed after redirect: %d", status);
+            return -1;
+        }
+    } else if (status != 200) {
+        LOG("DESCRIBE failed: %d", status);
+        return -1;
+    }
+    
+    char *sdp = malloc(msg.body_len + 1);
+    if (!sdp) return -1;
+    memcpy(sdp, msg.body, msg.body_len);
+    sdp[msg.body_len] = '\0';
+    LOG("SDP:\n%s", sdp);
+    
+    char group[64];
+    sdp_control_url(sdp, current_url, control_url, MAX_URL_LEN);
+    st->payload_type = sdp_mp2t_payload_type(sdp);
+    if (st->payload_type < 0) LOG("No MP2T payload type in SDP, accepting any");
+    multicast = sdp_multicast_group(sdp, group, sizeof(group)) == 0;
+    free(sdp);
+    
+    strcpy(zap->url, current_url);
+    zap->payload_type = st->payload_type;
+    zap->multicast = multicast;
+    LOG("SETUP target: %s", control_url);
+    
+setup:;
+    int status_setup = -1;
+    udp_rx_init(&st->udp);
+    
+    /* Prefer RTP over UDP (multicast when the SDP says so), fall back to TCP.
+     * The UDP receivers are IPv4 only. */
+    if (g_transport_udp && !st->force_tcp && sock_peer_family(*rtsp_fd) == AF_INET) {
+        if (multicast)
+            snprintf(extra, sizeof(extra), "Transport: RTP/AVP;multicast\r\n");
+        else if (udp_rx_open_unicast(&st->udp) == 0)
+            snprintf(extra, sizeof(extra), "Transport: RTP/AVP;unicast;client_port=%d-%d\r\n",
+                     st->udp.port, st->udp.port + 1);
+        else
+            extra[0] = '\0';
+        
+        if (extra[0]) {
+            status_setup = rtsp_transact(*rtsp_fd, rd, "SETUP", control_url, NULL, &cseq, extra, &msg, 10);
+            if (status_setup == 200 && strstr(msg.transport, "interleaved=")) {
+                udp_rx_close(&st->udp);
+            } else if (status_setup != 200 || udp_rx_accept(&st->udp, msg.transport) < 0) {
+                LOG("UDP transport refused (%d: %s), falling back to TCP", status_setup, msg.transport);
+                udp_rx_close(&st->udp);
+                status_setup = -1;
+            }
+        }
+    }
+    
+    if (status_setup != 200) {
+        snprintf(extra, sizeof(extra), "Transport: RTP/AVP/TCP;unicast;interleaved=0-1\r\n");
+        status_setup = rtsp_transact(*rtsp_fd, rd, "SETUP", control_url, NULL, &cseq, extra, &msg, 10);
+    }
+    if (status_setup != 200) {
+        LOG("SETUP failed");
+        return -1;
+    }
+    strcpy(session, msg.session);
+    int msg_timeout = msg.session_timeout;
+    LOG("Session: %s (timeout %d), Transport: %s", session, msg_timeout, msg.transport);
+    
+    st->rtp_channel = 0;
+    st->rtcp_channel = 1;
+    transport_param_pair(msg.transport, "interleaved", &st->rtp_channel, &st->rtcp_channel);
+    
+    snprintf(extra, sizeof(extra), "Range: npt=0.000-\r\n");
+    if (rtsp_transact(*rtsp_fd, rd, "PLAY", control_url, session, &cseq, extra, &msg, 10) != 200) {
+        LOG("PLAY failed");
+        return -1;
+    }
+    
+    /* What the relay needs to keep the session alive */
+    strcpy(st->control_url, control_url);
+    strcpy(st->session, session);
+    st->session_timeout = msg_timeout;
+    st->cseq = cseq;
+    st->caps = zap->caps;
+    st->next_keepalive = now_ms() + rtsp_keepalive_ms(msg_timeout);
+    return 0;
+}
+
+/* Depayloaded TS goes into the client's queue; the socket is served from there */
+static void relay_sink(void *ctx, const unsigned char *ts, int len) {
+    struct rtsp_stream *st = ctx;
+    media_ring_write(&st->media, ts, len);
+    gop_publish(&st->gop, &st->media.ts, ts, len);
+    stats_session_packet(st->stats, len, st->depay.lost, st->depay.reordered, st->media.rate.rate);
+}
+
+/*
+ * Serve the client between upstream reads and build the fd sets for the next
+ * select(). Returns -1 when the client is gone or stuck.
+ */
+static int relay_client_io(int client_fd, struct rtsp_stream *st, fd_set *wfds) {
+    int ret = vq_flush(client_fd, &st->out, &st->media);
+    if (ret < 0) {
+        LOG("Client disconnected");
+        return -1;
+    }
+    if (vq_stalled(&st->out)) {
+        LOG("Client stalled for %d seconds", VIEWER_STALL_TIMEOUT_SEC);
+        return -1;
+    }
+    FD_ZERO(wfds);
+    if (ret > 0) FD_SET(client_fd, wfds);
+    return 0;
+}
+
+#define RELAY_NO_DATA 1
+#define RELAY_UPSTREAM_LOST 2
+
+/* Keep the session alive between reads; the response arrives in-band and is skipped */
+static void relay_keepalive(int rtsp_fd, struct rtsp_stream *st) {
+    char req[MAX_HEADER_LEN];
+    uint64_t now = now_ms();
+    
+    if (now < st->next_keepalive) return;
+    st->next_keepalive = now + rtsp_keepalive_ms(st->session_timeout);
+    const char *method = rtsp_keepalive_method(st->caps);
+    LOG("Sending %s keepalive", method);
+    int len = format_rtsp_request(req, sizeof(req), method, st->control_url, st->session, st->cseq++, NULL);
+    send(rtsp_fd, req, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+/*
+ * Relay loop for RTP over UDP. The RTSP connection is still watched for
+ * in-band messages and for the server closing the session.
+ * Returns RELAY_NO_DATA if no datagram arrived in time, so the caller can
+ * retry over TCP, and RELAY_UPSTREAM_LOST if the session died later on.
+ */
+static int relay_udp_data(int rtsp_fd, struct rtsp_reader *rd, int client_fd,
+                          struct rtsp_stream *st) {
+    struct rtsp_msg msg;
+    fd_set rfds, wfds;
+    struct timeval tv;
+    int udp_fd = st->udp.rtp_fd;
+    int maxfd = rtsp_fd > udp_fd ? rtsp_fd : udp_fd;
+    uint64_t last_rx = now_ms();
+    
+    if (client_fd > maxfd) maxfd = client_fd;
+    
+    while (1) {
+        if (relay_client_io(client_fd, st, &wfds) < 0) break;
+        relay_keepalive(rtsp_fd, st);
+        if (st->udp.datagrams && now_ms() - last_rx >= RELAY_IDLE_TIMEOUT_SEC * 1000) {
+            LOG("Upstream idle for %d seconds", RELAY_IDLE_TIMEOUT_SEC);
+            return RELAY_UPSTREAM_LOST;
+        }
+        FD_ZERO(&rfds);
+        FD_SET(rtsp_fd, &rfds);
+        FD_SET(udp_fd, &rfds);
+        
+        tv.tv_sec = st->udp.datagrams ? 5 : UDP_FIRST_PACKET_TIMEOUT_SEC;
+        tv.tv_usec = 0;
+        
+        int n = select(maxfd + 1, &rfds, &wfds, NULL, &tv);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (n == 0) {
+            if (st->udp.datagrams == 0) {
+                LOG("No RTP over UDP within %d seconds", UDP_FIRST_PACKET_TIMEOUT_SEC);
+                return RELAY_NO_DATA;
+            }
+            continue;
+        }
+        
+        if (FD_ISSET(udp_fd, &rfds)) {
+            int r = udp_rx_read(&st->udp, &st->depay, relay_sink, st);
+            if (r < 0) return RELAY_UPSTREAM_LOST;
+            if (r > 0) last_rx = now_ms();
+        }
+        
+        if (FD_ISSET(rtsp_fd, &rfds)) {
+            int r = rtsp_reader_fill(rd, rtsp_fd);
+            if (r == 0) {
+                LOG("Upstream closed");
+                return RELAY_UPSTREAM_LOST;
+            }
+            if (r < 0 && errno != EAGAIN && errno != EINTR) rtsp_reader_reset(rd);
+            while ((r = rtsp_reader_next(rd, &msg)) > 0)
+                LOG("In-band RTSP message, CSeq %d", msg.cseq);
+            if (r < 0) rtsp_reader_reset(rd);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Relay loop for fork mode. Each wakeup reads as much as the buffer holds and
+ * demuxes every complete frame in place into the client's queue. The client
+ * is served from the queue whenever the buffer is drained, so a slow client
+ * never holds up the upstream socket. Both sockets are non-blocking and
+ * select() only runs when neither side can make progress.
+ */
+static int relay_rtp_data(int rtsp_fd, struct rtsp_reader *rd, int client_fd, struct rtsp_stream *st) {
+    struct rtsp_msg msg;
+    fd_set rfds, wfds;
+    struct timeval tv;
+    int error_count = 0;
+    int ret = RELAY_UPSTREAM_LOST;
+    uint64_t last_rx = now_ms();
+    
+    set_nonblocking(rtsp_fd);
+    set_nonblocking(client_fd);
+    rtp_depay_restart(&st->depay, st->payload_type);
+    
+    if (st->udp.rtp_fd >= 0) {
+        int ret = relay_udp_data(rtsp_fd, rd, client_fd, st);
+        LOG("RTP datagrams=%llu lost=%llu reordered=%llu rejected=%llu resyncs=%llu",
+            (unsigned long long)st->udp.datagrams, (unsigned long long)st->depay.lost,
+            (unsigned long long)st->depay.reordered, (unsigned long long)st->depay.rejected,
+            (unsigned long long)st->depay.resyncs);
+        return ret;
+    }
+    
+    while (error_count < 10) {
+        int r = rtsp_reader_next(rd, &msg);
+        if (r == RTSP_MSG_FRAME) {
+            const unsigned char *ts;
+            int ts_len;
+            if (msg.channel == st->rtp_channel &&
+                (ts_len = rtp_depay(&st->depay, msg.body, msg.body_len, &ts)) > 0) {
+                relay_sink(st, ts, ts_len);
+                last_rx = now_ms();
+            }
+            error_count = 0;
+            continue;
+        }
+        if (r == RTSP_MSG_RESPONSE || r == RTSP_MSG_REQUEST) {
+            LOG("In-band RTSP message, CSeq %d", msg.cseq);
+            continue;
+        }
+        
+        /* Buffer drained: serve the client before reading more */
+        if (relay_client_io(client_fd, st, &wfds) < 0) {
+            ret = 0;
+            break;
+        }
+        relay_keepalive(rtsp_fd, st);
+        if (now_ms() - last_rx >= RELAY_IDLE_TIMEOUT_SEC * 1000) {
+            LOG("Upstream idle for %d seconds", RELAY_IDLE_TIMEOUT_SEC);
+            break;
+        }
+        
+        if (r == RTSP_PARSE_ERROR) {
+            LOG("Unparseable upstream data, dropping %d bytes", rd->len - rd->off);
+            rtsp_reader_reset(rd);
+            error_count++;
+            continue;
+        }
+        
+        int n = rtsp_reader_fill(rd, rtsp_fd);
+        if (n > 0) continue;
+        if (n == 0) {
+            LOG("Upstream closed");
+            break;
+        }
+        if (errno == EINTR) continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            if (errno == ENOBUFS) rtsp_reader_reset(rd);
+            error_count++;
+            continue;
+        }
+        
+        FD_ZERO(&rfds);
+        FD_SET(rtsp_fd, &rfds);
+        
+        tv.tv_sec = 5;
+        tv.tv_usec = 0;
+        
+        if (select((rtsp_fd > client_fd ? rtsp_fd : client_fd) + 1, &rfds, &wfds, NULL, &tv) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+    }
+    
+    LOG("RTP packets=%llu lost=%llu reordered=%llu rejected=%llu resyncs=%llu",
+        (unsigned long long)st->depay.packets, (unsigned long long)st->depay.lost,
+        (unsigned long long)st->depay.reordered, (unsigned long long)st->depay.rejected,
+        (unsigned long long)st->depay.resyncs);
+    return ret;
+}
+
+/*
+ * Replay side of -C: a feeder process writes the recorded chunks into a
+ * socketpair, at the recorded pace or as fast as possible, and a sink
+ * process discards what the relay writes to its "client".
+ */
+static void replay_feed(FILE *fp, int fd, int paced) {
+    unsigned char hdr[8], *buf = NULL;
+    uint32_t cap = 0;
+    uint64_t start = now_us(), at = 0;
+    
+    while (fread(hdr, sizeof(hdr), 1, fp) == 1) {
+        uint32_t len = get_be32(hdr + 4);
+        if (len > cap) {
+            unsigned char *p = realloc(buf, len);
+            if (!p) break;
+            buf = p;
+            cap = len;
+        }
+        if (fread(buf, len, 1, fp) != 1) break;
+        at += get_be32(hdr);
+        if (paced) {
+            uint64_t now = now_us();
+            if (start + at > now) {
+                struct timespec ts = { (start + at - now) / 1000000, (start + at - now) % 1000000 * 1000 };
+                nanosleep(&ts, NULL);
+            }
+        }
+        if (send_all(fd, (const char*)buf, len, 30) < 0) break;
+    }
+    free(buf);
+}
+
+static void replay_drain(int fd) {
+    char buf[65536];
+    while (read(fd, buf, sizeof(buf)) > 0)
+        ;
+}
+
+/*
+ * -P: run a capture through relay_rtp_data() and report the data plane cost
+ * as JSON on stdout.
+ */
+static int replay_run(const char *file, int paced) {
+    unsigned char hdr[12];
+    char url[MAX_URL_LEN];
+    int up[2], down[2];
+    FILE *fp = fopen(file, "rb");
+    
+    if (!fp) {
+        perror(file);
+        return 1;
+    }
+    if (fread(hdr, sizeof(hdr), 1, fp) != 1 || memcmp(hdr, CAPTURE_MAGIC, 8) != 0) {
+        fprintf(stderr, "%s: not a capture file\n", file);
+        fclose(fp);
+        return 1;
+    }
+    int url_len = hdr[10] << 8 | hdr[11];
+    if (url_len >= (int)sizeof(url) || fread(url, url_len, 1, fp) != 1) url_len = 0;
+    url[url_len] = '\0';
+    
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, up) < 0 || socketpair(AF_UNIX, SOCK_STREAM, 0, down) < 0) {
+        perror("socketpair");
+        return 1;
+    }
+    pid_t feeder = fork();
+    if (feeder == 0) {
+        close(up[0]);
+        close(down[0]);
+        close(down[1]);
+        replay_feed(fp, up[1], paced);
+        _exit(0);
+    }
+    fclose(fp);
+    close(up[1]);
+    pid_t sink = fork();
+    if (sink == 0) {
+        close(up[0]);
+        close(down[0]);
+        replay_drain(down[1]);
+        _exit(0);
+    }
+    close(down[1]);
+    if (feeder < 0 || sink < 0) {
+        perror("fork");
+        return 1;
+    }
+    
+    struct rtsp_reader rd;
+    struct rtsp_stream st;
+    struct sockaddr_in addr;
+    unsigned char *rbuf = malloc(g_buf_size);
+    
+    memset(&st, 0, sizeof(st));
+    memset(&addr, 0, sizeof(addr));
+    st.rtp_channel = hdr[8];
+    st.rtcp_channel = hdr[8] + 1;
+    st.payload_type = hdr[9] == 0xff ? -1 : hdr[9];
+    st.udp.rtp_fd = -1;
+    st.next_keepalive = UINT64_MAX;     /* nobody reads the feeder side */
+    st.media.ring.size = g_ring_size;
+    st.media.ring.data = malloc(g_ring_size);
+    if (!rbuf || !st.media.ring.data) return 1;
+    rtsp_reader_init(&rd, rbuf, g_buf_size);
+    ts_tracker_init(&st.media.ts);
+    gop_writer_init(&st.gop, NULL);
+    vq_init(&st.out, &addr, 0, 0);
+    
+    struct rusage ru0, ru1;
+    getrusage(RUSAGE_SELF, &ru0);
+    uint64_t start = now_us();
+    relay_rtp_data(up[0], &rd, down[0], &st);
+    double wall = (now_us() - start) / 1e6;
+    getrusage(RUSAGE_SELF, &ru1);
+    
+    close(up[0]);
+    close(down[0]);
+    kill(feeder, SIGTERM);
+    waitpid(feeder, NULL, 0);
+    waitpid(sink, NULL, 0);
+    
+    double cpu = (ru1.ru_utime.tv_sec - ru0.ru_utime.tv_sec) + (ru1.ru_stime.tv_sec - ru0.ru_stime.tv_sec) +
+                 ((ru1.ru_utime.tv_usec - ru0.ru_utime.tv_usec) + (ru1.ru_stime.tv_usec - ru0.ru_stime.tv_usec)) / 1e6;
+    unsigned long long packets = st.depay.packets;
+    unsigned long long bytes = st.media.ring.head;
+    
+    printf("{\"file\":\"%s\",\"url\":\"%s\",\"paced\":%s,\"rtp_packets\":%llu,\"ts_bytes\":%llu,"
+           "\"wall_sec\":%.3f,\"mbyte_s\":%.2f,\"cpu_sec\":%.3f,\"cpu_ns_per_packet\":%.0f,"
+           "\"lost\":%llu,\"reordered\":%llu,\"rejected\":%llu,\"viewer_drops\":%llu}\n",
+           file, url, paced ? "true" : "false", packets, bytes,
+           wall, wall > 0 ? bytes / 1e6 / wall : 0, cpu, packets ? cpu * 1e9 / packets : 0,
+           (unsigned long long)st.depay.lost, (unsigned long long)st.depay.reordered,
+           (unsigned long long)st.depay.rejected, (unsigned long long)st.out.drops);
+    vq_free(&st.out);
+    free(st.media.ring.data);
+    free(rbuf);
+    return 0;
+}
+
+/* ============ 修改部分：URL解析逻辑 ============ */
+
+/*
+ * Extract the target RTSP URL from an HTTP request header.
+ * Returns NULL on success, otherwise the HTTP error response to send.
+ */
+static const char *http_request_rtsp_url(const char *request, char *rtsp_url, int url_len) {
+    /* ============ 新的URL解析逻辑 ============ */
+    /*
+     * 支持的格式：
+     * GET /rtsp://server:554/path HTTP/1.x
+     * GET /rtsp://server:554/path?query HTTP/1.x
+     * 
+     * 从请求行中提取 rtsp:// 开头的URL
+     */
+    
+    /* 找到请求行中的第一个空格（GET之后） */
+    const char *space1 = strchr(request, ' ');
+    if (!space1) {
+        return HTTP_400_BAD;
+    }
+    space1++;  /* 指向URL开始位置，应该是 /rtsp://... */
+    
+    /* 找到第二个空格（HTTP版本之前） */
+    const char *space2 = strchr(space1, ' ');
+    if (!space2) {
+        return HTTP_400_BAD;
+    }
+    
+    /* 提取路径部分 */
+    int path_len = space2 - space1;
+    if (path_len <= 0 || path_len >= MAX_URL_LEN) {
+        return HTTP_400_BAD;
+    }
+    
+    char path_part[MAX_URL_LEN];
+    strncpy(path_part, space1, path_len);
+    path_part[path_len] = '\0';
+    
+    LOG("Path part: %s", path_part);
+    
+    /* 检查是否以 /rtsp:// 或 /rtsp/ 开头 */
+    char *url_start = NULL;
+    if (strncmp(path_part, "/rtsp://", 8) == 0) {
+        url_start = path_part + 1;  /* 跳过第一个 /，得到 rtsp://... */
+    } else if (strncmp(path_part, "/rtsp/", 6) == 0) {
+        url_start = path_part + 1;  /* 跳过第一个 /，得到 rtsp/... */
+    } else {
+        LOG("Invalid URL format, must start with /rtsp:// or /rtsp/");
+        return HTTP_404_NOT;
+    }
+    
+    /* 处理可能的URL编码 */
+    url_decode(url_start, rtsp_url, url_len);
+    
+    LOG("Target RTSP: %s", rtsp_url);
+    
+    /* 验证RTSP URL格式 */
+    if (strncmp(rtsp_url, "rtsp://", 7) != 0 && strncmp(rtsp_url, "rtsp/", 5) != 0) {
+        return HTTP_400_BAD;
+    }
+    
+    return NULL;
+}
+
+static void handle_client(int client_fd, struct sockaddr_in *client_addr) {
+    char request[MAX_HEADER_LEN];
+    char rtsp_url[MAX_URL_LEN];
+    char host[256], path[MAX_URL_LEN];
+    int rtsp_port;
+    
+    LOG("Client connected from %s:%d", 
+        inet_ntoa(client_addr->sin_addr), ntohs(client_addr->sin_port));
+    
+    struct timeval tv;
+    tv.tv_sec = 10;
+    tv.tv_usec = 0;
+    setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    
+    /* 读取HTTP请求头 */
+    int total = 0;
+    int header_complete = 0;
+    while (total < sizeof(request) - 1) {
+        int n = recv(client_fd, request + total, sizeof(request) - 1 - total, 0);
+        if (n <= 0) goto cleanup;
+        total += n;
+        request[total] = '\0';
+        
+        if (strstr(request, "\r\n\r\n")) {
+            header_complete = 1;
+            break;
+        }
+    }
+    
+    if (!header_complete) {
+        send_all(client_fd, HTTP_400_BAD, strlen(HTTP_400_BAD), 2);
+        goto cleanup;
+    }
+    
+    LOG("Request: %.100s", request);
+    STATS_ADD(requests, 1);
+    
+    char *reply;
+    int reply_len = stats_reply(request, &reply);
+    if (reply_len != 0) {
+        if (reply_len > 0) {
+            send_all(client_fd, reply, reply_len, 2);
+            free(reply);
+        } else {
+            send_all(client_fd, HTTP_500_ERR, strlen(HTTP_500_ERR), 2);
+        }
+        goto cleanup;
+    }
+    
+    const char *err = http_request_rtsp_url(request, rtsp_url, sizeof(rtsp_url));
+    if (err) {
+        send_all(client_fd, err, strlen(err), 2);
+        goto cleanup;
+    }
+    
+    /* ============ 后续逻辑不变 ============ */
+    
+    if (parse_rtsp_url(rtsp_url, host, &rtsp_port, path, sizeof(path)) < 0) {
+        send_all(client_fd, HTTP_400_BAD, strlen(HTTP_400_BAD), 2);
+        goto cleanup;
+    }
+    
+    struct rtsp_reader rd;
+    unsigned char *rbuf = malloc(g_buf_size);
+    if (!rbuf) {
+        send_all(client_fd, HTTP_500_ERR, strlen(HTTP_500_ERR), 2);
+        goto cleanup;
+    }
+    rtsp_reader_init(&rd, rbuf, g_buf_size);
+    
+    struct rtsp_stream st;
+    struct zap_entry zap;
+    int started = 0;
+    memset(&st, 0, sizeof(st));
+    memset(&zap, 0, sizeof(zap));
+    
+    st.media.ring.size = g_ring_size;
+    if (!(st.media.ring.data = malloc(g_ring_size))) {
+        send_all(client_fd, HTTP_500_ERR, strlen(HTTP_500_ERR), 2);
+        free(rbuf);
+        goto cleanup;
+    }
+    ts_tracker_init(&st.media.ts);
+    
+    uint64_t zap_start = now_ms();
+    int warm = normalize_rtsp_url(rtsp_url, zap.key, sizeof(zap.key)) == 0 &&
+               zap_cache_get(zap.key, &zap);
+    gop_writer_init(&st.gop, zap.key);
+    vq_init(&st.out, client_addr, 0, zap_start);
+    
+    /* Another relay of this channel is live: show its last GOP while we set up */
+    unsigned char *burst;
+    int burst_len = zap.key[0] ? gop_snapshot(zap.key, &burst) : 0;
+    if (burst_len > 0) {
+        LOG("Sending %d byte keyframe burst", burst_len);
+        int ret = send_all(client_fd, HTTP_200_OK, strlen(HTTP_200_OK), 2);
+        if (ret >= 0) ret = send_all(client_fd, (const char*)burst, burst_len, 2);
+        if (ret >= 0) vq_sent(&st.out);
+        free(burst);
+        if (ret < 0) {
+            free(st.media.ring.data);
+            free(rbuf);
+            goto cleanup;
+        }
+        started = 1;
+    }
+    
+    /* A second pass over TCP if UDP was negotiated but no data arrived; a
+     * session lost during relay is set up again on the same transport */
+    int reconnects = 0;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        /* Once the redirect target is known, go straight to it */
+        if (zap.url[0] && parse_rtsp_url(zap.url, host, &rtsp_port, path, sizeof(path)) < 0)
+            zap.url[0] = '\0';
+        LOG("Connecting to %s:%d%s", host, rtsp_port, path);
+        
+        int rtsp_fd = rtsp_connect(host, rtsp_port);
+        if (rtsp_fd >= 0) {
+            rtsp_reader_reset(&rd);
+            st.force_tcp = attempt > 0;
+            if (rtsp_setup_play(&rtsp_fd, &rd, rtsp_url, &st, &zap) < 0) {
+                if (rtsp_fd >= 0) close(rtsp_fd);
+                udp_rx_close(&st.udp);
+                rtsp_fd = -1;
+            }
+        }
+        if (rtsp_fd < 0 && warm) {
+            LOG("Cached zap path failed, starting over");
+            zap_cache_drop(zap.key);
+            zap.url[0] = '\0';
+            warm = 0;
+            parse_rtsp_url(rtsp_url, host, &rtsp_port, path, sizeof(path));
+            attempt--;
+            continue;
+        }
+        if (rtsp_fd < 0 && reconnects > 0 && reconnects < UPSTREAM_MAX_RECONNECTS) {
+            LOG("Reconnect failed, retrying in %d ms", UPSTREAM_RECONNECT_DELAY_MS << reconnects);
+            poll(NULL, 0, UPSTREAM_RECONNECT_DELAY_MS << reconnects++);
+            attempt--;
+            continue;
+        }
+        if (rtsp_fd < 0) {
+            STATS_ADD(failed, 1);
+            if (!started)
+                send_all(client_fd, rtsp_fd == -2 ? HTTP_404_NOT : HTTP_500_ERR,
+                         strlen(rtsp_fd == -2 ? HTTP_404_NOT : HTTP_500_ERR), 2);
+            break;
+        }
+        
+        if (!started) {
+            LOG("Stream ready in %llu ms (%s zap)",
+                (unsigned long long)(now_ms() - zap_start), warm ? "warm" : "cold");
+            if (zap.key[0]) zap_cache_put(&zap);
+        }
+        
+        if (!started && send_all(client_fd, HTTP_200_OK, strlen(HTTP_200_OK), 2) < 0) {
+            close(rtsp_fd);
+            udp_rx_close(&st.udp);
+            break;
+        }
+        started = 1;
+        
+        if (reconnects > 0) vq_splice(&st.out);
+        LOG("Starting relay...");
+        uint64_t relay_since = now_ms();
+        if (!st.stats) st.stats = stats_session_open(zap.key[0] ? zap.key : rtsp_url);
+        if (st.udp.rtp_fd < 0)
+            rtsp_reader_capture(&rd, zap.key[0] ? zap.key : rtsp_url, st.rtp_channel, st.payload_type);
+        int ret = relay_rtp_data(rtsp_fd, &rd, client_fd, &st);
+        capture_close(rd.cap);
+        rd.cap = NULL;
+        
+        LOG("Closing RTSP connection");
+        close(rtsp_fd);
+        udp_rx_close(&st.udp);
+        if (ret == RELAY_UPSTREAM_LOST) {
+            /* The viewer is still connected: set the session up again under it */
+            if (now_ms() - relay_since >= UPSTREAM_STABLE_SEC * 1000) reconnects = 0;
+            if (reconnects >= UPSTREAM_MAX_RECONNECTS) {
+                LOG("Giving up after %d reconnects", reconnects);
+                break;
+            }
+            LOG("Upstream lost, reconnecting in %d ms", UPSTREAM_RECONNECT_DELAY_MS << reconnects);
+            poll(NULL, 0, UPSTREAM_RECONNECT_DELAY_MS << reconnects++);
+            warm = zap.key[0] && zap_cache_get(zap.key, &zap);
+            if (!warm) {
+                zap.url[0] = '\0';
+                parse_rtsp_url(rtsp_url, host, &rtsp_port, path, sizeof(path));
+            }
+            attempt--;
+            continue;
+        }
+        if (ret != RELAY_NO_DATA) break;
+        LOG("Retrying with RTP over TCP");
+    }
+    gop_writer_release(&st.gop);
+    stats_session_close(st.stats);
+    vq_free(&st.out);
+    free(st.media.ring.data);
+    free(rbuf);
+    
+cleanup:
+    close(client_fd);
+    LOG("Client handler exiting");
+}
+
+/* ============ 事件循环模式 (epoll) ============ */
+/*
+ * 单进程非阻塞模式：每个连接是一个状态机
+ * HTTP 请求 -> 连接上游 -> OPTIONS -> DESCRIBE -> SETUP -> PLAY -> 转发
+ * 所有超时挂在同一个定时器最小堆上。
+ */
+
+struct timer {
+    uint64_t expire;
+    int idx;                    /* heap slot, -1 when not armed */
+    void (*cb)(void *arg);
+    void *arg;
+};
+
+static struct timer **g_timer_heap = NULL;
+static int g_timer_count = 0;
+static int g_timer_cap = 0;
+
+static void timer_init(struct timer *t, void (*cb)(void *), void *arg) {
+    t->expire = 0;
+    t->idx = -1;
+    t->cb = cb;
+    t->arg = arg;
+}
+
+static void timer_swap(int a, int b) {
+    struct timer *t = g_timer_heap[a];
+    g_timer_heap[a] = g_timer_heap[b];
+    g_timer_heap[b] = t;
+    g_timer_heap[a]->idx = a;
+    g_timer_heap[b]->idx = b;
+}
+
+static void timer_sift_up(int i) {
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (g_timer_heap[parent]->expire <= g_timer_heap[i]->expire) break;
+        timer_swap(i, parent);
+        i = parent;
+    }
+}
+
+static void timer_sift_down(int i) {
+    while (1) {
+        int l = 2 * i + 1, r = l + 1, m = i;
+        if (l < g_timer_count && g_timer_heap[l]->expire < g_timer_heap[m]->expire) m = l;
+        if (r < g_timer_count && g_timer_heap[r]->expire < g_timer_heap[m]->expire) m = r;
+        if (m == i) break;
+        timer_swap(i, m);
+        i = m;
+    }
+}
+
+static void timer_cancel(struct timer *t) {
+    int i = t->idx;
+    if (i < 0) return;
+    g_timer_count--;
+    if (i != g_timer_count) {
+        g_timer_heap[i] = g_timer_heap[g_timer_count];
+        g_timer_heap[i]->idx = i;
+        timer_sift_down(i);
+        timer_sift_up(i);
+    }
+    t->idx = -1;
+}
+
+static void timer_arm(struct timer *t, int timeout_ms) {
+    timer_cancel(t);
+    if (g_timer_count == g_timer_cap) {
+        int cap = g_timer_cap ? g_timer_cap * 2 : 64;
+        struct timer **heap = realloc(g_timer_heap, cap * sizeof(*heap));
+        if (!heap) return;
+        g_timer_heap = heap;
+        g_timer_cap = cap;
+    }
+    t->expire = now_ms() + timeout_ms;
+    t->idx = g_timer_count;
+    g_timer_heap[g_timer_count++] = t;
+    timer_sift_up(t->idx);
+}
+
+/* Milliseconds until the earliest timer, -1 if none */
+static int timer_next_timeout(void) {
+    if (g_timer_count == 0) return -1;
+    uint64_t now = now_ms();
+    if (g_timer_heap[0]->expire <= now) return 0;
+    uint64_t diff = g_timer_heap[0]->expire - now;
+    return diff > 60000 ? 60000 : (int)diff;
+}
+
+static void timer_run(void) {
+    uint64_t now = now_ms();
+    while (g_timer_count > 0 && g_timer_heap[0]->expire <= now) {
+        struct timer *t = g_timer_heap[0];
+        timer_cancel(t);
+        t->cb(t->arg);
+    }
+}
+
+enum { EV_LISTEN, EV_CLIENT, EV_UPSTREAM, EV_UDP, EV_CONNECT, EV_DNS };
+
+struct ev_base {
+    int kind;
+    int fd;
+    int dead;
+    int added;                  /* registered with epoll */
+    uint32_t events;
+    struct ev_base *next_dead;
+};
+
+enum { CL_REQUEST, CL_SETUP, CL_RELAY, CL_REPLY };
+
+struct ev_client {
+    struct ev_base base;
+    int state;
+    struct sockaddr_in addr;
+    char req[MAX_HEADER_LEN];
+    int req_len;
+    uint64_t req_at;
+    char out[MAX_HEADER_LEN];   /* HTTP response header */
+    int out_len, out_off;
+    struct viewer_queue q;
+    struct timer timer;
+    struct ev_upstream *up;
+    struct ev_client *next_viewer;
+};
+
+enum { UP_RESOLVE, UP_CONNECT, UP_OPTIONS, UP_DESCRIBE, UP_SETUP, UP_PLAY, UP_RELAY, UP_BACKOFF };
+
+/* Secondary fd owned by an upstream session, e.g. its RTP/UDP socket */
+struct ev_sub {
+    struct ev_base base;
+    struct ev_upstream *up;
+    int idx;
+};
+
+/* Hostname lookup done by the resolver process, shared by all waiting upstreams */
+struct dns_job {
+    char host[256];
+    struct ev_upstream *waiters;
+    struct dns_job *next;
+};
+
+/* One upstream RTSP session, shared by every viewer of the same channel */
+struct ev_upstream {
+    struct ev_base base;
+    int state;
+    char key[MAX_URL_LEN];
+    char url[MAX_URL_LEN];
+    char control_url[MAX_URL_LEN];
+    char session[256];
+    int session_timeout;
+    int cseq;
+    int redirects;
+    int port;
+    int warm;                   /* handshake shortcut from the zap cache */
+    unsigned caps;
+    uint64_t zap_start;         /* channel open, 0 once the first PLAY is done */
+    uint64_t req_at;
+    const char *req_method;
+    struct dns_job *dns;        /* lookup in flight */
+    struct ev_upstream *dns_next;
+    struct conn_race race;
+    struct ev_sub conn_ev[DNS_MAX_ADDRS];
+    struct rtsp_reader rd;
+    char wbuf[MAX_HEADER_LEN];
+    int wlen, woff;
+    uint64_t last_rx;
+    struct timer timer;
+    struct timer ka_timer;      /* session keepalive while relaying */
+    uint64_t relay_since;
+    int reconnects;             /* in a row, without a stable relay in between */
+    int splice;                 /* the next PLAY resumes under existing viewers */
+    struct rtp_depay depay;
+    struct gop_writer gop;
+    struct stats_session *stats;
+    int rtp_channel;
+    int multicast;              /* SDP announces a multicast session */
+    int setup_udp;              /* SETUP in flight asks for UDP */
+    int force_tcp;
+    struct udp_rx udp;
+    struct ev_sub udp_ev;
+    struct media_ring media;
+    struct ev_client *viewers;
+    int viewer_count;
+    struct ev_upstream *next;
+};
+
+static int g_epfd = -1;
+static struct ev_base *g_dead_list = NULL;
+static struct ev_upstream *g_channels = NULL;
+static int g_active_clients = 0;
+static struct dns_job *g_dns_jobs = NULL;
+static struct ev_base g_dns_ev;
+static pid_t g_dns_pid = -1;
+
+static void ev_set(struct ev_base *b, uint32_t events) {
+    struct epoll_event ev;
+    if (b->fd < 0 || b->events == events) return;
+    ev.events = events;
+    ev.data.ptr = b;
+    epoll_ctl(g_epfd, b->added ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, b->fd, &ev);
+    b->added = 1;
+    b->events = events;
+}
+
+static void ev_close_fd(struct ev_base *b) {
+    if (b->fd < 0) return;
+    epoll_ctl(g_epfd, EPOLL_CTL_DEL, b->fd, NULL);
+    close(b->fd);
+    b->fd = -1;
+    b->added = 0;
+    b->events = 0;
+}
+
+/* Objects are freed after the current epoll batch so stale events stay harmless */
+static void ev_bury(struct ev_base *b) {
+    b->dead = 1;
+    b->next_dead = g_dead_list;
+    g_dead_list = b;
+}
+
+static void ev_free_dead(void) {
+    while (g_dead_list) {
+        struct ev_base *b = g_dead_list;
+        g_dead_list = b->next_dead;
+        free(b);
+    }
+}
+
+static void ev_client_close(struct ev_client *cl);
+static void ev_client_fail(struct ev_client *cl, const char *resp);
+
+static void ev_upstream_restart_tcp(struct ev_upstream *up);
+static const char *ev_upstream_connect(struct ev_upstream *up);
+static void ev_upstream_setup(struct ev_upstream *up);
+
+static void ev_dns_cancel(struct ev_upstream *up);
+
+static void ev_upstream_udp_close(struct ev_upstream *up) {
+    if (up->udp_ev.base.fd >= 0) {
+        ev_close_fd(&up->udp_ev.base);
+        up->udp.rtp_fd = -1;
+    }
+    udp_rx_close(&up->udp);
+}
+
+static void ev_upstream_close(struct ev_upstream *up) {
+    struct ev_upstream **pp;
+    
+    if (up->base.dead) return;
+    for (pp = &g_channels; *pp; pp = &(*pp)->next) {
+        if (*pp == up) {
+            *pp = up->next;
+            break;
+        }
+    }
+    
+    /* Best-effort TEARDOWN so the server can release the session at once */
+    if (up->state == UP_RELAY && up->base.fd >= 0) {
+        up->wlen = format_rtsp_request(up->wbuf, sizeof(up->wbuf), "TEARDOWN", up->control_url,
+                                       up->session, up->cseq++, NULL);
+        send(up->base.fd, up->wbuf, up->wlen, MSG_NOSIGNAL | MSG_DONTWAIT);
+    }
+    
+    ev_dns_cancel(up);
+    conn_race_abort(&up->race);
+    ev_upstream_udp_close(up);
+    gop_writer_release(&up->gop);
+    stats_session_close(up->stats);
+    up->stats = NULL;
+    LOG("Closing upstream %s: RTP packets=%llu lost=%llu reordered=%llu rejected=%llu resyncs=%llu",
+        up->key, (unsigned long long)up->depay.packets, (unsigned long long)up->depay.lost,
+        (unsigned long long)up->depay.reordered, (unsigned long long)up->depay.rejected,
+        (unsigned long long)up->depay.resyncs);
+    timer_cancel(&up->timer);
+    timer_cancel(&up->ka_timer);
+    ev_close_fd(&up->base);
+    capture_close(up->rd.cap);
+    up->rd.cap = NULL;
+    free(up->rd.buf);
+    free(up->media.ring.data);
+    up->rd.buf = NULL;
+    up->media.ring.data = NULL;
+    ev_bury(&up->base);
+}
+
+static void ev_viewer_detach(struct ev_client *cl) {
+    struct ev_upstream *up = cl->up;
+    struct ev_client **pp;
+    
+    if (!up) return;
+    for (pp = &up->viewers; *pp; pp = &(*pp)->next_viewer) {
+        if (*pp == cl) {
+            *pp = cl->next_viewer;
+            break;
+        }
+    }
+    cl->up = NULL;
+    cl->next_viewer = NULL;
+    
+    /* The upstream session lives only as long as someone is watching */
+    if (--up->viewer_count == 0)
+        ev_upstream_close(up);
+    else if (up->stats)
+        up->stats->viewers = up->viewer_count;
+}
+
+static void ev_client_close(struct ev_client *cl) {
+    if (cl->base.dead) return;
+    LOG("Closing client %s:%d", inet_ntoa(cl->addr.sin_addr), ntohs(cl->addr.sin_port));
+    ev_viewer_detach(cl);
+    timer_cancel(&cl->timer);
+    ev_close_fd(&cl->base);
+    vq_free(&cl->q);
+    g_active_clients--;
+    ev_bury(&cl->base);
+}
+
+/* Best-effort error reply, the socket buffer is empty at this point */
+static void ev_client_fail(struct ev_client *cl, const char *resp) {
+    if (cl->base.fd >= 0)
+        send(cl->base.fd, resp, strlen(resp), MSG_NOSIGNAL | MSG_DONTWAIT);
+    ev_client_close(cl);
+}
+
+/* A cached zap shortcut failed: forget it and redo the full handshake */
+static int ev_upstream_retry_cold(struct ev_upstream *up) {
+    LOG("Cached zap path failed, starting over");
+    zap_cache_drop(up->key);
+    up->warm = 0;
+    up->redirects = 0;
+    up->session[0] = '\0';
+    timer_cancel(&up->timer);
+    ev_dns_cancel(up);
+    conn_race_abort(&up->race);
+    ev_upstream_udp_close(up);
+    ev_close_fd(&up->base);
+    strcpy(up->url, up->key);
+    return ev_upstream_connect(up) ? -1 : 0;
+}
+
+/*
+ * The session broke after it had been playing and viewers are still there:
+ * drop the connection and set the session up again after a backoff, through
+ * the zap cache while it still holds the redirect target and SDP. Viewers
+ * keep their HTTP connection and their place in the ring.
+ */
+static int ev_upstream_reconnect(struct ev_upstream *up) {
+    struct zap_entry zap;
+    
+    if (up->state == UP_RELAY && now_ms() - up->relay_since >= UPSTREAM_STABLE_SEC * 1000)
+        up->reconnects = 0;
+    if (up->reconnects >= UPSTREAM_MAX_RECONNECTS) {
+        LOG("Giving up on %s after %d reconnects", up->key, up->reconnects);
+        return -1;
+    }
+    int delay = UPSTREAM_RECONNECT_DELAY_MS << up->reconnects++;
+    LOG("Upstream %s lost, reconnecting in %d ms (attempt %d/%d)", up->key, delay,
+        up->reconnects, UPSTREAM_MAX_RECONNECTS);
+    
+    timer_cancel(&up->ka_timer);
+    ev_dns_cancel(up);
+    conn_race_abort(&up->race);
+    ev_upstream_udp_close(up);
+    ev_close_fd(&up->base);
+    capture_close(up->rd.cap);
+    up->rd.cap = NULL;
+    up->session[0] = '\0';
+    up->redirects = 0;
+    up->wlen = up->woff = 0;
+    
+    up->warm = zap_cache_get(up->key, &zap);
+    if (up->warm) {
+        strcpy(up->url, zap.url);
+        strcpy(up->control_url, zap.control_url);
+        rtp_depay_restart(&up->depay, zap.payload_type);
+        up->multicast = zap.multicast;
+        up->caps = zap.caps;
+    } else {
+        strcpy(up->url, up->key);
+    }
+    up->splice = 1;
+    up->state = UP_BACKOFF;
+    timer_arm(&up->timer, delay);
+    return 0;
+}
+
+/* Close the session and every viewer attached to it */
+static void ev_upstream_fail_with(struct ev_upstream *up, const char *resp) {
+    struct ev_client *cl, *next;
+    
+    if (up->warm && up->state != UP_RELAY && ev_upstream_retry_cold(up) == 0)
+        return;
+    if (up->zap_start == 0 && up->viewers && ev_upstream_reconnect(up) == 0)
+        return;
+    if (up->state != UP_RELAY) STATS_ADD(failed, 1);
+    
+    cl = up->viewers;
+    up->viewers = NULL;
+    up->viewer_count = 0;
+    ev_upstream_close(up);
+    
+    for (; cl; cl = next) {
+        next = cl->next_viewer;
+        cl->up = NULL;
+        cl->next_viewer = NULL;
+        if (cl->state == CL_RELAY)
+            ev_client_close(cl);
+        else
+            ev_client_fail(cl, resp);
+    }
+}
+
+static void ev_upstream_fail(struct ev_upstream *up) {
+    ev_upstream_fail_with(up, HTTP_500_ERR);
+}
+
+
+/*
+ * Send the pending response header, then the viewer's queue. Viewers that
+ * fall behind are thinned out by vq_flush() rather than holding up the channel.
+ */
+static void ev_client_flush(struct ev_client *cl) {
+    struct ev_upstream *up = cl->up;
+    int pending = 0;
+    
+    while (cl->out_off < cl->out_len) {
+        int n = send(cl->base.fd, cl->out + cl->out_off, cl->out_len - cl->out_off, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            LOG("Client disconnected");
+            ev_client_close(cl);
+            return;
+        }
+        cl->out_off += n;
+    }
+    
+    if (cl->out_off < cl->out_len) {
+        pending = 1;
+    } else if (cl->state == CL_REPLY) {
+        while (cl->q.pend_off < cl->q.pend_len) {
+            int n = send(cl->base.fd, cl->q.pend + cl->q.pend_off, cl->q.pend_len - cl->q.pend_off,
+                         MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            if (n < 0) {
+                ev_client_close(cl);
+                return;
+            }
+            cl->q.pend_off += n;
+        }
+        if (cl->q.pend_off == cl->q.pend_len) {
+            ev_client_close(cl);
+            return;
+        }
+        pending = 1;
+    } else if (cl->state == CL_RELAY && up) {
+        pending = vq_flush(cl->base.fd, &cl->q, &up->media);
+        if (pending < 0) {
+            LOG("Client disconnected");
+            ev_client_close(cl);
+            return;
+        }
+    }
+    ev_set(&cl->base, pending ? EPOLLIN | EPOLLOUT : EPOLLIN);
+}
+
+static void ev_client_queue(struct ev_client *cl, const void *data, int len) {
+    if (cl->out_len + len > (int)sizeof(cl->out)) {
+        LOG("Client output buffer full, dropping %d bytes", len);
+        return;
+    }
+    memcpy(cl->out + cl->out_len, data, len);
+    cl->out_len += len;
+}
+
+static void ev_upstream_send(struct ev_upstream *up) {
+    while (up->woff < up->wlen) {
+        int n = send(up->base.fd, up->wbuf + up->woff, up->wlen - up->woff, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            ev_upstream_fail(up);
+            return;
+        }
+        up->woff += n;
+    }
+    ev_set(&up->base, up->woff < up->wlen ? EPOLLIN | EPOLLOUT : EPOLLIN);
+}
+
+static void ev_upstream_request(struct ev_upstream *up, int state, const char *method,
+                                const char *url, const char *session, const char *extra) {
+    LOG("Sending %s", method);
+    up->req_at = now_ms();
+    up->req_method = method;
+    up->wlen = format_rtsp_request(up->wbuf, sizeof(up->wbuf), method, url, session, up->cseq++, extra);
+    up->woff = 0;
+    up->state = state;
+    timer_arm(&up->timer, RTSP_RESPONSE_TIMEOUT_SEC * 1000);
+    ev_upstream_send(up);
+}
+
+/* Keepalive on the session; the response is skipped as an in-band message */
+static void ev_upstream_keepalive(void *arg) {
+    struct ev_upstream *up = arg;
+    
+    if (up->state != UP_RELAY || up->base.fd < 0) return;
+    timer_arm(&up->ka_timer, rtsp_keepalive_ms(up->session_timeout));
+    if (up->woff < up->wlen) return;
+    
+    const char *method = rtsp_keepalive_method(up->caps);
+    LOG("Sending %s keepalive for %s", method, up->key);
+    up->wlen = format_rtsp_request(up->wbuf, sizeof(up->wbuf), method, up->control_url,
+                                   up->session, up->cseq++, NULL);
+    up->woff = 0;
+    ev_upstream_send(up);
+}
+
+/* Start another connect attempt if one is left and arm the timer for the next step */
+static int ev_upstream_race_next(struct ev_upstream *up) {
+    int i = conn_race_launch(&up->race);
+    if (i >= 0) {
+        struct ev_sub *sub = &up->conn_ev[i];
+        memset(&sub->base, 0, sizeof(sub->base));
+        sub->base.kind = EV_CONNECT;
+        sub->base.fd = up->race.fds[i];
+        sub->up = up;
+        sub->idx = i;
+        ev_set(&sub->base, EPOLLOUT);
+    }
+    if (up->race.pending == 0) return -1;
+    
+    uint64_t now = now_ms(), wake = conn_race_wakeup(&up->race);
+    timer_arm(&up->timer, wake > now ? (int)(wake - now) : 0);
+    return 0;
+}
+
+static const char *ev_upstream_race(struct ev_upstream *up, const struct dns_result *res) {
+    conn_race_init(&up->race, res, up->port);
+    up->state = UP_CONNECT;
+    if (ev_upstream_race_next(up) < 0) {
+        LOG("Failed to connect to upstream");
+        return HTTP_500_ERR;
+    }
+    return NULL;
+}
+
+static void ev_upstream_connect_event(struct ev_sub *sub) {
+    struct ev_upstream *up = sub->up;
+    
+    if (up->state != UP_CONNECT || up->race.fds[sub->idx] != sub->base.fd)
+        return;     /* attempt already closed */
+    int fd = conn_race_finish(&up->race, sub->idx);
+    if (fd < 0) {
+        if (ev_upstream_race_next(up) < 0) {
+            LOG("Failed to connect to upstream");
+            ev_upstream_fail(up);
+        }
+        return;
+    }
+    
+    /* The winning socket moves from the attempt to the session itself */
+    epoll_ctl(g_epfd, EPOLL_CTL_DEL, fd, NULL);
+    up->base.fd = fd;
+    up->base.added = 0;
+    up->base.events = 0;
+    if (up->warm) {
+        LOG("Warm zap: SETUP %s", up->control_url);
+        ev_upstream_setup(up);
+        return;
+    }
+    ev_upstream_request(up, UP_OPTIONS, "OPTIONS", up->url, NULL, NULL);
+}
+
+/*
+ * getaddrinfo() blocks, so the event loop forks a resolver process at startup,
+ * before any client socket exists, and talks to it over a SEQPACKET pair.
+ */
+struct dns_request {
+    struct dns_job *job;
+    char host[256];
+};
+
+struct dns_reply {
+    struct dns_job *job;
+    struct dns_result res;
+};
+
+static void dns_resolver_main(int fd) {
+    struct dns_request req;
+    struct dns_reply rep;
+    
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    while (recv(fd, &req, sizeof(req), 0) == sizeof(req)) {
+        req.host[sizeof(req.host)-1] = '\0';
+        rep.job = req.job;
+        dns_lookup(req.host, &rep.res);
+        dns_cache_put(req.host, &rep.res);
+        if (send(fd, &rep, sizeof(rep), MSG_NOSIGNAL) < 0) break;
+    }
+    exit(0);
+}
+
+static int ev_dns_start(int listen_fd) {
+    int sv[2];
+    
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0) {
+        PERROR("socketpair");
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        PERROR("fork");
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        close(sv[0]);
+        close(listen_fd);
+        close(g_epfd);
+        dns_resolver_main(sv[1]);
+    }
+    
+    close(sv[1]);
+    set_nonblocking(sv[0]);
+    g_dns_pid = pid;
+    memset(&g_dns_ev, 0, sizeof(g_dns_ev));
+    g_dns_ev.kind = EV_DNS;
+    g_dns_ev.fd = sv[0];
+    ev_set(&g_dns_ev, EPOLLIN);
+    LOG("Resolver process pid=%d", pid);
+    return 0;
+}
+
+/* Queue a lookup, joining one already in flight for the same host */
+static int ev_dns_submit(struct ev_upstream *up, const char *host) {
+    struct dns_request req;
+    struct dns_job *job;
+    
+    if (g_dns_ev.fd < 0 || strlen(host) >= sizeof(req.host)) return -1;
+    for (job = g_dns_jobs; job; job = job->next) {
+        if (strcmp(job->host, host) == 0) break;
+    }
+    if (!job) {
+        job = calloc(1, sizeof(*job));
+        if (!job) return -1;
+        strcpy(job->host, host);
+        req.job = job;
+        strcpy(req.host, host);
+        if (send(g_dns_ev.fd, &req, sizeof(req), MSG_NOSIGNAL) != sizeof(req)) {
+            free(job);
+            return -1;
+        }
+        job->next = g_dns_jobs;
+        g_dns_jobs = job;
+        LOG("Resolving %s", host);
+    }
+    up->dns = job;
+    up->dns_next = job->waiters;
+    job->waiters = up;
+    return 0;
+}
+
+static void ev_dns_cancel(struct ev_upstream *up) {
+    struct ev_upstream **pp;
+    
+    if (!up->dns) return;
+    for (pp = &up->dns->waiters; *pp; pp = &(*pp)->dns_next) {
+        if (*pp == up) {
+            *pp = up->dns_next;
+            break;
+        }
+    }
+    up->dns = NULL;
+    up->dns_next = NULL;
+}
+
+static void ev_dns_done(struct dns_job *job, const struct dns_result *res) {
+    struct ev_upstream *up, *next;
+    
+    if (res->naddr == 0) LOG("Failed to resolve host: %s", job->host);
+    for (up = job->waiters; up; up = next) {
+        next = up->dns_next;
+        up->dns = NULL;
+        up->dns_next = NULL;
+        const char *err = res->naddr ? ev_upstream_race(up, res) : HTTP_404_NOT;
+        if (err) ev_upstream_fail_with(up, err);
+    }
+    free(job);
+}
+
+static void ev_dns_readable(void) {
+    struct dns_reply rep;
+    struct dns_job **pp, *job;
+    ssize_t n;
+    
+    while ((n = recv(g_dns_ev.fd, &rep, sizeof(rep), 0)) == sizeof(rep)) {
+        for (pp = &g_dns_jobs; *pp && *pp != rep.job; pp = &(*pp)->next);
+        if (!*pp) continue;
+        job = *pp;
+        *pp = job->next;
+        ev_dns_done(job, &rep.res);
+    }
+    if (n > 0 || (n < 0 && (errno == EAGAIN || errno == EINTR))) return;
+    
+    /* Resolver gone: finish what was queued inline, later lookups block */
+    LOG("Resolver process exited");
+    ev_close_fd(&g_dns_ev);
+    waitpid(g_dns_pid, NULL, WNOHANG);
+    while ((job = g_dns_jobs)) {
+        g_dns_jobs = job->next;
+        dns_lookup(job->host, &rep.res);
+        dns_cache_put(job->host, &rep.res);
+        ev_dns_done(job, &rep.res);
+    }
+}
+
+/*
+ * Start resolving and connecting to the host in up->url.
+ * Returns NULL on success, otherwise the HTTP error response for the client.
+ */
+static const char *ev_upstream_connect(struct ev_upstream *up) {
+    char host[256], path[MAX_URL_LEN];
+    struct dns_result res;
+    int port;
+    
+    if (parse_rtsp_url(up->url, host, &port, path, sizeof(path)) < 0)
+        return HTTP_400_BAD;
+    
+    LOG("Connecting to %s:%d%s", host, port, path);
+    up->port = port;
+    rtsp_reader_reset(&up->rd);
+    up->cseq = 1;
+    
+    if (!dns_numeric(host, &res) && !dns_cache_get(host, &res)) {
+        if (ev_dns_submit(up, host) == 0) {
+            up->state = UP_RESOLVE;
+            timer_arm(&up->timer, RTSP_CONNECT_TIMEOUT_SEC * 1000);
+            return NULL;
+        }
+        dns_lookup(host, &res);
+        dns_cache_put(host, &res);
+    }
+    if (res.naddr == 0) {
+        LOG("Failed to resolve host: %s", host);
+        return HTTP_404_NOT;
+    }
+    return ev_upstream_race(up, &res);
+}
+
+static void ev_upstream_timeout(void *arg) {
+    struct ev_upstream *up = arg;
+    
+    if (up->state == UP_BACKOFF) {
+        if (ev_upstream_connect(up)) ev_upstream_fail(up);
+        return;
+    }
+    if (up->state == UP_CONNECT && now_ms() < up->race.deadline &&
+        ev_upstream_race_next(up) == 0)
+        return;
+    if (up->state == UP_RELAY && up->udp.rtp_fd >= 0 && up->udp.datagrams == 0) {
+        ev_upstream_restart_tcp(up);
+        return;
+    }
+    if (up->state == UP_RELAY) {
+        uint64_t idle = now_ms() - up->last_rx;
+        if (idle < RELAY_IDLE_TIMEOUT_SEC * 1000) {
+            timer_arm(&up->timer, RELAY_IDLE_TIMEOUT_SEC * 1000 - (int)idle);
+            return;
+        }
+        LOG("Upstream idle for %d seconds", RELAY_IDLE_TIMEOUT_SEC);
+    } else {
+        LOG("Upstream timeout in state %d", up->state);
+    }
+    ev_upstream_fail(up);
+}
+
+/* Push newly written ring data to every viewer; a closing viewer may end the session */
+static void ev_upstream_notify(struct ev_upstream *up) {
+    struct ev_client *cl, *next;
+    
+    up->viewer_count++;     /* hold the session while iterating */
+    for (cl = up->viewers; cl; cl = next) {
+        next = cl->next_viewer;
+        if (cl->state == CL_RELAY && !(cl->base.events & EPOLLOUT))
+            ev_client_flush(cl);
+    }
+    if (--up->viewer_count == 0)
+        ev_upstream_close(up);
+}
+
+static void ev_viewer_start(struct ev_client *cl) {
+    cl->state = CL_RELAY;
+    vq_init(&cl->q, &cl->addr, cl->up->media.ring.head, cl->req_at);
+    cl->q.pend_len = cl->q.pend_cap = gop_snapshot(cl->up->key, &cl->q.pend);
+    if (cl->q.pend_len > 0) LOG("Sending %d byte keyframe burst", cl->q.pend_len);
+    timer_arm(&cl->timer, VIEWER_STALL_TIMEOUT_SEC * 1000);
+    ev_client_queue(cl, HTTP_200_OK, strlen(HTTP_200_OK));
+    ev_client_flush(cl);
+}
+
+static void ev_upstream_playing(struct ev_upstream *up) {
+    struct ev_client *cl, *next;
+    
+    if (up->zap_start) {
+        struct zap_entry zap;
+        LOG("Stream ready in %llu ms (%s zap)",
+            (unsigned long long)(now_ms() - up->zap_start), up->warm ? "warm" : "cold");
+        up->zap_start = 0;
+        
+        memset(&zap, 0, sizeof(zap));
+        strcpy(zap.key, up->key);
+        strcpy(zap.url, up->url);
+        strcpy(zap.control_url, up->control_url);
+        zap.payload_type = up->depay.payload_type;
+        zap.multicast = up->multicast;
+        zap.caps = up->caps;
+        zap_cache_put(&zap);
+    }
+    
+    LOG("Starting relay for %d viewer(s)...", up->viewer_count);
+    up->state = UP_RELAY;
+    if (up->udp.rtp_fd < 0)
+        rtsp_reader_capture(&up->rd, up->url, up->rtp_channel, up->depay.payload_type);
+    up->last_rx = up->relay_since = now_ms();
+    timer_arm(&up->ka_timer, rtsp_keepalive_ms(up->session_timeout));
+    if (up->udp.rtp_fd >= 0)
+        timer_arm(&up->timer, UDP_FIRST_PACKET_TIMEOUT_SEC * 1000);
+    else
+        timer_arm(&up->timer, RELAY_IDLE_TIMEOUT_SEC * 1000);
+    
+    up->viewer_count++;
+    for (cl = up->viewers; cl; cl = next) {
+        next = cl->next_viewer;
+        if (cl->state != CL_RELAY)
+            ev_viewer_start(cl);
+        else if (up->splice)
+            vq_splice(&cl->q);
+    }
+    up->splice = 0;
+    if (--up->viewer_count == 0)
+        ev_upstream_close(up);
+}
+
+/* Ask for RTP over UDP first when enabled, otherwise (or after a refusal) TCP */
+static void ev_upstream_setup(struct ev_upstream *up) {
+    char extra[256];
+    
+    up->setup_udp = 0;
+    if (g_transport_udp && !up->force_tcp && sock_peer_family(up->base.fd) == AF_INET) {
+        if (up->multicast) {
+            snprintf(extra, sizeof(extra), "Transport: RTP/AVP;multicast\r\n");
+            up->setup_udp = 1;
+        } else if (udp_rx_open_unicast(&up->udp) == 0) {
+            snprintf(extra, sizeof(extra), "Transport: RTP/AVP;unicast;client_port=%d-%d\r\n",
+                     up->udp.port, up->udp.port + 1);
+            up->setup_udp = 1;
+        }
+    }
+    if (!up->setup_udp)
+        snprintf(extra, sizeof(extra), "Transport: RTP/AVP/TCP;unicast;interleaved=0-1\r\n");
+    
+    ev_upstream_request(up, UP_SETUP, "SETUP", up->control_url, NULL, extra);
+}
+
+static void ev_ring_sink(void *ctx, const unsigned char *ts, int len) {
+    struct ev_upstream *up = ctx;
+    media_ring_write(&up->media, ts, len);
+    gop_publish(&up->gop, &up->media.ts, ts, len);
+    stats_session_packet(up->stats, len, up->depay.lost, up->depay.reordered, up->media.rate.rate);
+}
+
+static void ev_upstream_udp_readable(struct ev_upstream *up) {
+    uint64_t head = up->media.ring.head;
+    
+    if (udp_rx_read(&up->udp, &up->depay, ev_ring_sink, up) > 0)
+        up->last_rx = now_ms();
+    if (up->media.ring.head != head) ev_upstream_notify(up);
+}
+
+/* UDP was accepted but nothing arrives (firewall, NAT): start over on TCP */
+static void ev_upstream_restart_tcp(struct ev_upstream *up) {
+    struct ev_client *cl;
+    
+    LOG("No RTP over UDP within %d seconds, retrying with RTP over TCP", UDP_FIRST_PACKET_TIMEOUT_SEC);
+    ev_upstream_udp_close(up);
+    timer_cancel(&up->timer);
+    ev_close_fd(&up->base);
+    up->force_tcp = 1;
+    up->session[0] = '\0';
+    
+    const char *err = ev_upstream_connect(up);
+    if (err) {
+        ev_upstream_fail(up);
+        return;
+    }
+    for (cl = up->viewers; cl; cl = cl->next_viewer)
+        LOG("Viewer %s:%d kept open", inet_ntoa(cl->addr.sin_addr), ntohs(cl->addr.sin_port));
+}
+
+/*
+ * Handle the response to the request in flight during session setup.
+ * Returns 1 if the reader was reset or the upstream closed.
+ */
+static int ev_upstream_response(struct ev_upstream *up, const struct rtsp_msg *msg) {
+    int status = msg->status;
+    
+    switch (up->state) {
+    case UP_OPTIONS:
+        if (status != 200) break;
+        up->caps = msg->caps;
+        ev_upstream_request(up, UP_DESCRIBE, "DESCRIBE", up->url, NULL, "Accept: application/sdp\r\n");
+        return 0;
+        
+    case UP_DESCRIBE:
+        if (status == 302) {
+            LOG("Received 302 redirect to: %s", msg->location);
+            if (msg->location[0] == '\0' || ++up->redirects > RTSP_MAX_REDIRECTS) {
+                LOG("Invalid or too many redirects");
+                break;
+            }
+            timer_cancel(&up->timer);
+            ev_close_fd(&up->base);
+            strncpy(up->url, msg->location, sizeof(up->url)-1);
+            if (ev_upstream_connect(up) != NULL) break;
+            return 1;
+        }
+        if (status != 200) {
+            LOG("DESCRIBE failed: %d", status);
+            break;
+        }
+        {
+            char *sdp = malloc(msg->body_len + 1);
+            if (!sdp) break;
+            memcpy(sdp, msg->body, msg->body_len);
+            sdp[msg->body_len] = '\0';
+            LOG("SDP:\n%s", sdp);
+            sdp_control_url(sdp, up->url, up->control_url, sizeof(up->control_url));
+            rtp_depay_restart(&up->depay, sdp_mp2t_payload_type(sdp));
+            if (up->depay.payload_type < 0) LOG("No MP2T payload type in SDP, accepting any");
+            char group[64];
+            up->multicast = sdp_multicast_group(sdp, group, sizeof(group)) == 0;
+            free(sdp);
+        }
+        LOG("SETUP target: %s", up->control_url);
+        ev_upstream_setup(up);
+        return 0;
+        
+    case UP_SETUP:
+        if (up->setup_udp) {
+            up->setup_udp = 0;
+            if (status == 200 && strstr(msg->transport, "interleaved=")) {
+                ev_upstream_udp_close(up);
+            } else if (status != 200 || udp_rx_accept(&up->udp, msg->transport) < 0) {
+                LOG("UDP transport refused (%d: %s), falling back to TCP", status, msg->transport);
+                ev_upstream_udp_close(up);
+                up->force_tcp = 1;
+                ev_upstream_setup(up);
+                return 0;
+            }
+        }
+        if (status != 200 || msg->session[0] == '\0') {
+            LOG("SETUP failed");
+            break;
+        }
+        strcpy(up->session, msg->session);
+        up->session_timeout = msg->session_timeout;
+        LOG("Session: %s (timeout %d), Transport: %s", up->session, up->session_timeout, msg->transport);
+        {
+            int rtcp_channel;
+            up->rtp_channel = 0;
+            transport_param_pair(msg->transport, "interleaved", &up->rtp_channel, &rtcp_channel);
+        }
+        if (up->udp.rtp_fd >= 0) {
+            up->udp_ev.base.kind = EV_UDP;
+            up->udp_ev.base.fd = up->udp.rtp_fd;
+            up->udp_ev.up = up;
+            ev_set(&up->udp_ev.base, EPOLLIN);
+        }
+        ev_upstream_request(up, UP_PLAY, "PLAY", up->control_url, up->session, "Range: npt=0.000-\r\n");
+        return 0;
+        
+    case UP_PLAY:
+        if (status != 200) {
+            LOG("PLAY failed");
+            break;
+        }
+        ev_upstream_playing(up);
+        return 0;
+    }
+    
+    ev_upstream_fail(up);
+    return 1;
 }
 
-static int relay_rtp_data(int rtsp_fd, int client_fd) {
-    unsigned char *buf = malloc(g_buf_size);
-    if (!buf) return -1;
+static void ev_upstream_readable(struct ev_upstream *up) {
+    struct rtsp_msg msg;
+    int relayed = 0;
     
-    fd_set rfds;
-    struct timeval tv;
-    int max_fd = (rtsp_fd > client_fd ? rtsp_fd : client_fd) + 1;
-    int running = 1;
-    int error_count = 0;
+    int n = rtsp_reader_fill(&up->rd, up->base.fd);
+    if (n <= 0) {
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) return;
+        LOG("Upstream closed");
+        ev_upstream_fail(up);
+        return;
+    }
     
-    while (running && error_count < 10) {
-        FD_ZERO(&rfds);
-        FD_SET(rtsp_fd, &rfds);
-        
-        tv.tv_sec = 5;
-        tv.tv_usec = 0;
+    while (1) {
+        int r = rtsp_reader_next(&up->rd, &msg);
+        if (r == RTSP_NEED_MORE) break;
         
-        int ret = select(max_fd, &rfds, NULL, NULL, &tv);
-        if (ret < 0) {
-            if (errno == EINTR) continue;
+        if (r == RTSP_PARSE_ERROR) {
+            if (up->state != UP_RELAY) {
+                ev_upstream_fail(up);
+                return;
+            }
+            LOG("Unparseable upstream data, dropping %d bytes", up->rd.len - up->rd.off);
+            rtsp_reader_reset(&up->rd);
             break;
         }
-        if (ret == 0) continue;
         
-        if (FD_ISSET(rtsp_fd, &rfds)) {
-            unsigned char header[4];
-            int n = recv(rtsp_fd, header, 1, MSG_PEEK);
-            if (n <= 0) { error_count++; continue; }
-            
-            if (header[0] != RTP_INTERLEAVED) {
-                char line[MAX_HEADER_LEN];
-                if (recv_line(rtsp_fd, line, sizeof(line), 2) <= 0)
-                    error_count++;
-                continue;
-            }
-            
-            n = recv(rtsp_fd, header, 4, MSG_WAITALL);
-            if (n != 4) { error_count++; continue; }
-            
-            int channel = header[1];
-            int length = (header[2] << 8) | header[3];
-            
-            if (length > g_buf_size - 4) length = g_buf_size - 4;
-            
-            int received = 0;
-            while (received < length) {
-                n = recv(rtsp_fd, buf + 4 + received, length - received, 0);
-                if (n <= 0) { error_count++; break; }
-                received += n;
-            }
-            if (received < length) continue;
-            
-            if (channel == 0) {
-                if (send_all(client_fd, (char*)buf + 4, received, 2) < 0) {
-                    LOG("Client disconnected");
-                    running = 0;
-                    break;
-                }
+        if (r == RTSP_MSG_FRAME) {
+            const unsigned char *ts;
+            int ts_len;
+            if (up->state == UP_RELAY && msg.channel == up->rtp_channel &&
+                (ts_len = rtp_depay(&up->depay, msg.body, msg.body_len, &ts)) > 0) {
+                ev_ring_sink(up, ts, ts_len);
+                relayed = 1;
             }
-            error_count = 0;
+            continue;
+        }
+        
+        if (r == RTSP_MSG_REQUEST || up->state == UP_RELAY) {
+            LOG("In-band RTSP message, CSeq %d", msg.cseq);
+            continue;
+        }
+        
+        LOG("RTSP status: %d ;CSeq: %d (%s took %llu ms)", msg.status, msg.cseq,
+            up->req_method, (unsigned long long)(now_ms() - up->req_at));
+        stats_observe(stats_method_phase(up->req_method), now_ms() - up->req_at);
+        if (msg.cseq >= 0 && msg.cseq != up->cseq - 1) {
+            LOG("Ignoring response for CSeq %d", msg.cseq);
+            continue;
         }
+        if (ev_upstream_response(up, &msg) || up->base.dead)
+            return;
     }
     
-    free(buf);
-    return 0;
+    if (relayed) {
+        up->last_rx = now_ms();
+        ev_upstream_notify(up);
+    }
 }
 
-/* ============ 修改部分：URL解析逻辑 ============ */
+static void ev_upstream_event(struct ev_upstream *up, uint32_t events) {
+    if ((events & EPOLLOUT) && up->woff < up->wlen) {
+        ev_upstream_send(up);
+        if (up->base.dead || up->base.fd < 0) return;
+    }
+    if (events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+        ev_upstream_readable(up);
+}
 
-static void handle_client(int client_fd, struct sockaddr_in *client_addr) {
-    char request[MAX_HEADER_LEN];
-    char rtsp_url[MAX_URL_LEN];
-    char host[256], path[MAX_URL_LEN];
-    int rtsp_port;
+static void ev_client_timeout(void *arg) {
+    struct ev_client *cl = arg;
     
-    LOG("Client connected from %s:%d", 
-        inet_ntoa(client_addr->sin_addr), ntohs(client_addr->sin_port));
+    if (cl->state == CL_RELAY) {
+        /* Relaying viewers are only dropped when their socket stays full */
+        if (!vq_stalled(&cl->q)) {
+            timer_arm(&cl->timer, cl->q.blocked ?
+                      cl->q.last_sent + VIEWER_STALL_TIMEOUT_SEC * 1000 - now_ms() :
+                      VIEWER_STALL_TIMEOUT_SEC * 1000);
+            return;
+        }
+        LOG("Client stalled for %d seconds", VIEWER_STALL_TIMEOUT_SEC);
+    } else {
+        LOG("Client request timeout");
+    }
+    ev_client_close(cl);
+}
+
+static void ev_client_request(struct ev_client *cl) {
+    char rtsp_url[MAX_URL_LEN];
+    char key[MAX_URL_LEN];
+    struct ev_upstream *up;
     
-    struct timeval tv;
-    tv.tv_sec = 10;
-    tv.tv_usec = 0;
-    setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    LOG("Request: %.100s", cl->req);
+    cl->req_at = now_ms();
+    STATS_ADD(requests, 1);
     
-    /* 读取HTTP请求头 */
-    int total = 0;
-    int header_complete = 0;
-    while (total < sizeof(request) - 1) {
-        int n = recv(client_fd, request + total, sizeof(request) - 1 - total, 0);
-        if (n <= 0) goto cleanup;
-        total += n;
-        request[total] = '\0';
-        
-        if (strstr(request, "\r\n\r\n")) {
-            header_complete = 1;
-            break;
+    /* Local reply kept in the queue's pending buffer, the request timer still runs */
+    char *reply;
+    int reply_len = stats_reply(cl->req, &reply);
+    if (reply_len != 0) {
+        if (reply_len < 0) {
+            ev_client_fail(cl, HTTP_500_ERR);
+            return;
         }
+        cl->state = CL_REPLY;
+        cl->q.pend = (unsigned char*)reply;
+        cl->q.pend_len = cl->q.pend_cap = reply_len;
+        ev_client_flush(cl);
+        return;
     }
     
-    if (!header_complete) {
-        send_all(client_fd, HTTP_400_BAD, strlen(HTTP_400_BAD), 2);
-        goto cleanup;
+    const char *err = http_request_rtsp_url(cl->req, rtsp_url, sizeof(rtsp_url));
+    if (!err && normalize_rtsp_url(rtsp_url, key, sizeof(key)) < 0)
+        err = HTTP_400_BAD;
+    if (err) {
+        ev_client_fail(cl, err);
+        return;
     }
     
-    LOG("Request: %.100s", request);
-    
-    /* ============ 新的URL解析逻辑 ============ */
-    /*
-     * 支持的格式：
-     * GET /rtsp://server:554/path HTTP/1.x
-     * GET /rtsp://server:554/path?query HTTP/1.x
-     * 
-     * 从请求行中提取 rtsp:// 开头的URL
-     */
-    
-    /* 找到请求行中的第一个空格（GET之后） */
-    char *space1 = strchr(request, ' ');
-    if (!space1) {
-        send_all(client_fd, HTTP_400_BAD, strlen(HTTP_400_BAD), 2);
-        goto cleanup;
-    }
-    space1++;  /* 指向URL开始位置，应该是 /rtsp://... */
+    timer_cancel(&cl->timer);
+    cl->state = CL_SETUP;
     
-    /* 找到第二个空格（HTTP版本之前） */
-    char *space2 = strchr(space1, ' ');
-    if (!space2) {
-        send_all(client_fd, HTTP_400_BAD, strlen(HTTP_400_BAD), 2);
-        goto cleanup;
+    for (up = g_channels; up; up = up->next) {
+        if (strcmp(up->key, key) == 0) break;
     }
     
-    /* 提取路径部分 */
-    int path_len = space2 - space1;
-    if (path_len <= 0 || path_len >= MAX_URL_LEN) {
-        send_all(client_fd, HTTP_400_BAD, strlen(HTTP_400_BAD), 2);
-        goto cleanup;
+    if (up) {
+        /* Channel already open: attach to the shared session */
+        cl->up = up;
+        cl->next_viewer = up->viewers;
+        up->viewers = cl;
+        up->viewer_count++;
+        if (up->stats) up->stats->viewers = up->viewer_count;
+        LOG("Joined channel %s, viewers=%d", key, up->viewer_count);
+        if (up->state == UP_RELAY)
+            ev_viewer_start(cl);
+        return;
     }
     
-    char path_part[MAX_URL_LEN];
-    strncpy(path_part, space1, path_len);
-    path_part[path_len] = '\0';
-    
-    LOG("Path part: %s", path_part);
-    
-    /* 检查是否以 /rtsp:// 或 /rtsp/ 开头 */
-    char *url_start = NULL;
-    if (strncmp(path_part, "/rtsp://", 8) == 0) {
-        url_start = path_part + 1;  /* 跳过第一个 /，得到 rtsp://... */
-    } else if (strncmp(path_part, "/rtsp/", 6) == 0) {
-        url_start = path_part + 1;  /* 跳过第一个 /，得到 rtsp/... */
-    } else {
-        LOG("Invalid URL format, must start with /rtsp:// or /rtsp/");
-        send_all(client_fd, HTTP_404_NOT, strlen(HTTP_404_NOT), 2);
-        goto cleanup;
+    up = calloc(1, sizeof(*up));
+    if (up) {
+        up->rd.buf = malloc(g_buf_size);
+        up->media.ring.data = malloc(g_ring_size);
     }
-    
-    /* 处理可能的URL编码 */
-    url_decode(url_start, rtsp_url, sizeof(rtsp_url));
-    
-    LOG("Target RTSP: %s", rtsp_url);
-    
-    /* 验证RTSP URL格式 */
-    if (strncmp(rtsp_url, "rtsp://", 7) != 0 && strncmp(rtsp_url, "rtsp/", 5) != 0) {
-        send_all(client_fd, HTTP_400_BAD, strlen(HTTP_400_BAD), 2);
-        goto cleanup;
+    if (!up || !up->rd.buf || !up->media.ring.data) {
+        if (up) {
+            free(up->rd.buf);
+            free(up->media.ring.data);
+            free(up);
+        }
+        ev_client_fail(cl, HTTP_500_ERR);
+        return;
     }
+    up->base.kind = EV_UPSTREAM;
+    up->base.fd = -1;
+    up->udp_ev.base.fd = -1;
+    udp_rx_init(&up->udp);
+    conn_race_init(&up->race, NULL, 0);
+    gop_writer_init(&up->gop, up->key);
+    up->media.ring.size = g_ring_size;
+    ts_tracker_init(&up->media.ts);
+    rtsp_reader_init(&up->rd, up->rd.buf, g_buf_size);
+    timer_init(&up->timer, ev_upstream_timeout, up);
+    timer_init(&up->ka_timer, ev_upstream_keepalive, up);
+    strncpy(up->key, key, sizeof(up->key)-1);
     
-    /* ============ 后续逻辑不变 ============ */
+    // Convert URL to standard rtsp:// format if needed
+    if (strncmp(rtsp_url, "rtsp/", 5) == 0)
+        snprintf(up->url, sizeof(up->url), "rtsp://%s", rtsp_url + 5);
+    else
+        strncpy(up->url, rtsp_url, sizeof(up->url)-1);
     
-    if (parse_rtsp_url(rtsp_url, host, &rtsp_port, path, sizeof(path)) < 0) {
-        send_all(client_fd, HTTP_400_BAD, strlen(HTTP_400_BAD), 2);
-        goto cleanup;
+    struct zap_entry zap;
+    up->zap_start = now_ms();
+    if (zap_cache_get(key, &zap)) {
+        up->warm = 1;
+        strcpy(up->url, zap.url);
+        strcpy(up->control_url, zap.control_url);
+        rtp_depay_init(&up->depay, zap.payload_type);
+        up->multicast = zap.multicast;
+        up->caps = zap.caps;
     }
     
-    LOG("Connecting to %s:%d%s", host, rtsp_port, path);
+    up->next = g_channels;
+    g_channels = up;
+    cl->up = up;
+    up->viewers = cl;
+    up->viewer_count = 1;
+    up->stats = stats_session_open(key);
+    LOG("Opening channel %s", key);
     
-    int rtsp_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (rtsp_fd < 0) {
-        send_all(client_fd, HTTP_500_ERR, strlen(HTTP_500_ERR), 2);
-        goto cleanup;
+    err = ev_upstream_connect(up);
+    if (err) {
+        STATS_ADD(failed, 1);
+        up->viewers = NULL;
+        up->viewer_count = 0;
+        cl->up = NULL;
+        ev_upstream_close(up);
+        ev_client_fail(cl, err);
     }
-    
-    struct hostent *he = gethostbyname(host);
-    if (!he) {
-        send_all(client_fd, HTTP_404_NOT, strlen(HTTP_404_NOT), 2);
-        close(rtsp_fd);
-        goto cleanup;
+}
+
+static void ev_client_event(struct ev_client *cl, uint32_t events) {
+    if (events & EPOLLOUT) {
+        ev_client_flush(cl);
+        if (cl->base.dead) return;
     }
+    if (!(events & (EPOLLIN | EPOLLERR | EPOLLHUP))) return;
     
-    struct sockaddr_in rtsp_addr;
-    memset(&rtsp_addr, 0, sizeof(rtsp_addr));
-    rtsp_addr.sin_family = AF_INET;
-    rtsp_addr.sin_port = htons(rtsp_port);
-    memcpy(&rtsp_addr.sin_addr, he->h_addr, he->h_length);
-    
-    tv.tv_sec = 10;
-    tv.tv_usec = 0;
-    setsockopt(rtsp_fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
-    
-    if (connect(rtsp_fd, (struct sockaddr*)&rtsp_addr, sizeof(rtsp_addr)) < 0) {
-        send_all(client_fd, HTTP_500_ERR, strlen(HTTP_500_ERR), 2);
-        close(rtsp_fd);
-        goto cleanup;
+    if (cl->state != CL_REQUEST) {
+        /* Nothing is expected from the player once the request is in */
+        char buf[256];
+        int n = recv(cl->base.fd, buf, sizeof(buf), 0);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+            ev_client_close(cl);
+        return;
     }
     
-    set_tcp_nodelay(rtsp_fd);
-    
-    int rtp_ch, rtcp_ch;
-    if (rtsp_setup_play(rtsp_fd, rtsp_url, &rtp_ch, &rtcp_ch) < 0) {
-        send_all(client_fd, HTTP_500_ERR, strlen(HTTP_500_ERR), 2);
-        close(rtsp_fd);
-        goto cleanup;
+    int n = recv(cl->base.fd, cl->req + cl->req_len, sizeof(cl->req) - 1 - cl->req_len, 0);
+    if (n <= 0) {
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) return;
+        ev_client_close(cl);
+        return;
     }
+    cl->req_len += n;
+    cl->req[cl->req_len] = '\0';
     
-    if (send_all(client_fd, HTTP_200_OK, strlen(HTTP_200_OK), 2) < 0) {
-        close(rtsp_fd);
-        goto cleanup;
+    if (strstr(cl->req, "\r\n\r\n"))
+        ev_client_request(cl);
+    else if (cl->req_len >= (int)sizeof(cl->req) - 1)
+        ev_client_fail(cl, HTTP_400_BAD);
+}
+
+static void ev_accept(int listen_fd) {
+    while (1) {
+        struct sockaddr_in client_addr;
+        socklen_t addr_len = sizeof(client_addr);
+        
+        int client_fd = accept(listen_fd, (struct sockaddr*)&client_addr, &addr_len);
+        if (client_fd < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) PERROR("accept");
+            return;
+        }
+        
+        if (g_active_clients >= g_max_clients) {
+            send(client_fd, HTTP_503_BUSY, strlen(HTTP_503_BUSY), MSG_NOSIGNAL | MSG_DONTWAIT);
+            STATS_ADD(rejected, 1);
+            close(client_fd);
+            continue;
+        }
+        
+        struct ev_client *cl = calloc(1, sizeof(*cl));
+        if (!cl) {
+            close(client_fd);
+            continue;
+        }
+        
+        set_nonblocking(client_fd);
+        set_tcp_nodelay(client_fd);
+        
+        cl->base.kind = EV_CLIENT;
+        cl->base.fd = client_fd;
+        cl->state = CL_REQUEST;
+        cl->addr = client_addr;
+        timer_init(&cl->timer, ev_client_timeout, cl);
+        timer_arm(&cl->timer, HTTP_REQUEST_TIMEOUT_SEC * 1000);
+        ev_set(&cl->base, EPOLLIN);
+        g_active_clients++;
+        
+        LOG("Client connected from %s:%d, active=%d/%d",
+            inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port),
+            g_active_clients, g_max_clients);
     }
-    
-    LOG("Starting relay...");
-    relay_rtp_data(rtsp_fd, client_fd);
-    
-    LOG("Closing RTSP connection");
-    close(rtsp_fd);
-    
-cleanup:
-    close(client_fd);
-    LOG("Client handler exiting");
 }
 
-static int run_server(void) {
-    int listen_fd;
-    struct sockaddr_in serv_addr;
+static int run_event_loop(int listen_fd) {
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+    struct ev_base listener;
     
-    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (listen_fd < 0) {
-        PERROR("socket");
+    g_epfd = epoll_create(EPOLL_MAX_EVENTS);
+    if (g_epfd < 0) {
+        PERROR("epoll_create");
         return 1;
     }
     
-    int yes = 1;
-    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
-    
-    memset(&serv_addr, 0, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_addr.s_addr = INADDR_ANY;
-    serv_addr.sin_port = htons(g_port);
-    
-    if (bind(listen_fd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
-        PERROR("bind");
-        close(listen_fd);
-        return 1;
-    }
+    set_nonblocking(listen_fd);
+    memset(&listener, 0, sizeof(listener));
+    listener.kind = EV_LISTEN;
+    listener.fd = listen_fd;
+    ev_set(&listener, EPOLLIN);
+    g_dns_ev.fd = -1;
+    ev_dns_start(listen_fd);
     
-    if (listen(listen_fd, 5) < 0) {
-        PERROR("listen");
-        close(listen_fd);
-        return 1;
+    while (1) {
+        int n = epoll_wait(g_epfd, events, EPOLL_MAX_EVENTS, timer_next_timeout());
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            PERROR("epoll_wait");
+            break;
+        }
+        
+        for (int i = 0; i < n; i++) {
+            struct ev_base *b = events[i].data.ptr;
+            if (b->dead) continue;
+            switch (b->kind) {
+            case EV_LISTEN:   ev_accept(b->fd); break;
+            case EV_CLIENT:   ev_client_event((struct ev_client*)b, events[i].events); break;
+            case EV_UPSTREAM: ev_upstream_event((struct ev_upstream*)b, events[i].events); break;
+            case EV_UDP:
+                if (!((struct ev_sub*)b)->up->base.dead)
+                    ev_upstream_udp_readable(((struct ev_sub*)b)->up);
+                break;
+            case EV_CONNECT:
+                if (!((struct ev_sub*)b)->up->base.dead)
+                    ev_upstream_connect_event((struct ev_sub*)b);
+                break;
+            case EV_DNS:      ev_dns_readable(); break;
+            }
+        }
+        
+        timer_run();
+        ev_free_dead();
     }
     
-    LOG("http2rtsp v%s (built on %s %s) listening on port %d", VERSION, BUILD_DATE, BUILD_TIME, g_port);
-    LOG("Buffer size: %d KB, Max clients: %d", g_buf_size/1024, g_max_clients);
-    LOG("URL format: http://host:%d/rtsp://server:554/path", g_port);
-    
+    close(g_epfd);
+    return 1;
+}
+
+static int run_fork_server(int listen_fd) {
     signal(SIGCHLD, sigchld_handler);
-    signal(SIGPIPE, SIG_IGN);
     
     int active_clients = 0;
     
@@ -793,6 +4559,7 @@ static int run_server(void) {
         
         if (active_clients >= g_max_clients) {
             send_all(client_fd, HTTP_503_BUSY, strlen(HTTP_503_BUSY), 2);
+            STATS_ADD(rejected, 1);
             close(client_fd);
             continue;
         }
@@ -818,16 +4585,78 @@ static int run_server(void) {
         }
     }
     
-    close(listen_fd);
     return 0;
 }
 
+static int run_server(void) {
+    int listen_fd;
+    struct sockaddr_in serv_addr;
+    int ret;
+    
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        PERROR("socket");
+        return 1;
+    }
+    
+    int yes = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    
+    memset(&serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_addr.s_addr = INADDR_ANY;
+    serv_addr.sin_port = htons(g_port);
+    
+    if (bind(listen_fd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
+        PERROR("bind");
+        close(listen_fd);
+        return 1;
+    }
+    
+    if (listen(listen_fd, 5) < 0) {
+        PERROR("listen");
+        close(listen_fd);
+        return 1;
+    }
+    
+    LOG("http2rtsp v%s (built on %s %s) listening on port %d", VERSION, BUILD_DATE, BUILD_TIME, g_port);
+    LOG("Buffer size: %d KB, Max clients: %d, Mode: %s", g_buf_size/1024, g_max_clients,
+        g_fork_mode ? "fork" : "epoll");
+    LOG("URL format: http://host:%d/rtsp://server:554/path", g_port);
+    
+    signal(SIGPIPE, SIG_IGN);
+    g_dns_cache = shm_alloc(sizeof(*g_dns_cache));
+    g_zap_cache = shm_alloc(sizeof(*g_zap_cache));
+    g_stats = shm_alloc(sizeof(*g_stats));
+    gop_pool_init(g_gop_cache_size);
+    
+    if (g_fork_mode)
+        ret = run_fork_server(listen_fd);
+    else
+        ret = run_event_loop(listen_fd);
+    
+    close(listen_fd);
+    return ret;
+}
+
 static void usage(const char *prog) {
     printf("http2rtsp v%s (built on %s %s) - Lightweight HTTP to RTSP proxy\n", VERSION, BUILD_DATE, BUILD_TIME);
-    printf("Usage: %s [-p port] [-c clients] [-B sizeK] [-v] [-T]\n", prog);
+    printf("Usage: %s [-p port] [-c clients] [-B sizeK] [-R sizeK] [-Q ms] [-G sizeK] [-t udp|tcp] [-U min-max] [-C dir] [-F] [-v] [-T]\n"
+           "       %s -P capture [-l] [-B sizeK] [-R sizeK] [-Q ms] [-v]\n", prog, prog);
     printf("  -p port     : HTTP listen port (default: %d)\n", DEFAULT_PORT);
     printf("  -c clients  : max concurrent clients (default: %d)\n", MAX_CLIENTS);
     printf("  -B sizeK    : buffer size in KB (default: %d)\n", DEFAULT_BUF_SIZE/1024);
+    printf("  -R sizeK    : shared channel ring size in KB, per client in fork mode (default: %d)\n", DEFAULT_RING_SIZE/1024);
+    printf("  -Q ms       : media a slow viewer may lag before video is dropped (default: %d)\n", DEFAULT_QUEUE_MS);
+    printf("  -G sizeK    : keyframe (GOP) cache for all channels in KB, %d KB per channel, 0 disables (default: %d)\n",
+           GOP_SLOT_SIZE/1024, DEFAULT_GOP_CACHE_SIZE/1024);
+    printf("  -t udp|tcp  : RTP transport, udp tries UDP/multicast first and falls back to TCP (default: tcp)\n");
+    printf("  -U min-max  : local UDP port range for RTP/RTCP pairs (default: %d-%d)\n",
+           DEFAULT_UDP_PORT_MIN, DEFAULT_UDP_PORT_MAX);
+    printf("  -C dir      : record upstream data after PLAY (TCP interleaved) into dir\n");
+    printf("  -P capture  : replay a recording through the relay and print its cost, then exit\n");
+    printf("  -l          : replay at the recorded pace instead of as fast as possible\n");
+    printf("  -F          : fork one process per client instead of the epoll event loop\n");
     printf("  -v          : verbose mode\n");
     printf("  -T          : do not run as daemon\n");
     printf("\nURL format: http://host:%d/rtsp://server:port/path\n", DEFAULT_PORT);
@@ -836,6 +4665,8 @@ static void usage(const char *prog) {
 
 int main(int argc, char *argv[]) {
     int opt;
+    const char *replay_file = NULL;
+    int replay_paced = 0;
     char *argv_copy[argc + 1];
     
     for (int i = 0; i < argc; i++) {
@@ -843,11 +4674,26 @@ int main(int argc, char *argv[]) {
     }
     argv_copy[argc] = NULL;
     
-    while ((opt = getopt(argc, argv, "c:B:p:vTh")) != -1) {
+    while ((opt = getopt(argc, argv, "c:B:R:Q:G:p:t:U:C:P:lFvTh")) != -1) {
         switch (opt) {
             case 'p': g_port = atoi(optarg); break;
             case 'c': g_max_clients = atoi(optarg); break;
             case 'B': g_buf_size = atoi(optarg) * 1024; break;
+            case 'R': g_ring_size = atoi(optarg) * 1024; break;
+            case 'Q': g_queue_ms = atoi(optarg); break;
+            case 'G': g_gop_cache_size = atoi(optarg) * 1024; break;
+            case 't': g_transport_udp = strcmp(optarg, "udp") == 0; break;
+            case 'U':
+                if (sscanf(optarg, "%d-%d", &g_udp_port_min, &g_udp_port_max) != 2 ||
+                    g_udp_port_min <= 0 || g_udp_port_max > 65534 || g_udp_port_min >= g_udp_port_max) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'C': g_capture_dir = optarg; break;
+            case 'P': replay_file = optarg; break;
+            case 'l': replay_paced = 1; break;
+            case 'F': g_fork_mode = 1; break;
             case 'v': g_verbose = 1; break;
             case 'T': g_daemon = 0; break;
             case 'h': usage(argv[0]); return 0;
@@ -859,6 +4705,8 @@ int main(int argc, char *argv[]) {
         argv[i] = argv_copy[i];
     }
     
+    if (replay_file) return replay_run(replay_file, replay_paced);
+    
     if (g_daemon && daemon(0, 0) < 0) {
         PERROR("daemon");
         return 1;